@@ -0,0 +1,144 @@
+/* memmap: turn a heap snapshot written by mem_snapshot() into a
+ * fragmentation map.
+ *
+ *	memmap <snapshot> [cells]
+ *
+ * prints what the pool holds, its free blocks by size and, for every chunk,
+ * a map of cells characters (1024 by default), 64 to a line, each standing
+ * for an equal share of the chunk:
+ *	'#' allocated, '+' mostly allocated, '-' mostly free, '.' free
+ */
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include "mymem.h"
+
+#define LINE 64
+
+static const char *strategy_names[] = {"none", "best", "worst", "first", "next", "region", "adaptive"};
+
+static void print_chunk(struct mem_snapshot_block *r, size_t n, size_t cells)
+{
+	size_t size = 0, cell, i, c;
+	size_t *freed;
+
+	for (i = 0; i < n; i++)
+		size += r[i].size;
+	if (size == 0)
+		return;
+	if (cells > size)
+		cells = size;
+	cell = (size + cells - 1) / cells;
+	cells = (size + cell - 1) / cell;
+	freed = calloc(cells, sizeof(size_t));
+	if (freed == NULL)
+		return;
+
+	/* free bytes in each cell */
+	for (i = 0; i < n; i++) {
+		size_t lo = r[i].offset - r[0].offset, hi = lo + r[i].size;
+
+		if (r[i].flags & MEM_SNAPSHOT_ALLOC)
+			continue;
+		while (lo < hi) {
+			size_t end = (lo / cell + 1) * cell;
+
+			if (end > hi)
+				end = hi;
+			freed[lo / cell] += end - lo;
+			lo = end;
+		}
+	}
+
+	printf("chunk %u: %zu bytes in %zu blocks, %zu bytes per character\n", r[0].chunk, size, n, cell);
+	for (c = 0; c < cells; c++) {
+		size_t span = c == cells - 1 ? size - c * cell : cell;
+
+		if (c % LINE == 0)
+			printf("  %10zu ", c * cell);
+		if (freed[c] == 0)
+			putchar('#');
+		else if (freed[c] == span)
+			putchar('.');
+		else
+			putchar(2 * freed[c] < span ? '+' : '-');
+		if (c % LINE == LINE - 1 || c == cells - 1)
+			putchar('\n');
+	}
+	free(freed);
+}
+
+int main(int argc, char **argv)
+{
+	struct mem_snapshot_header h;
+	struct mem_snapshot_block *r;
+	size_t holes = 0, freebytes = 0, largest = 0, used = 0, usedbytes = 0;
+	size_t direct = 0, directbytes = 0;
+	size_t hist[MEM_HIST_BUCKETS] = {0};
+	size_t cells = 1024, i, start;
+	FILE *f;
+	int b;
+
+	if (argc < 2) {
+		printf("Usage: memmap <snapshot> [cells]\n");
+		return 1;
+	}
+	if (argc > 2 && atol(argv[2]) > 0)
+		cells = atol(argv[2]);
+
+	f = fopen(argv[1], "rb");
+	if (f == NULL) {
+		perror(argv[1]);
+		return 1;
+	}
+	if (fread(&h, sizeof(h), 1, f) != 1 || memcmp(h.magic, MEM_SNAPSHOT_MAGIC, sizeof(h.magic)) != 0
+	    || h.version != MEM_SNAPSHOT_VERSION || h.record_size != sizeof(*r)) {
+		printf("%s is not a heap snapshot\n", argv[1]);
+		return 1;
+	}
+	r = malloc(h.blocks * sizeof(*r) + 1);
+	if (r == NULL || fread(r, sizeof(*r), h.blocks, f) != h.blocks) {
+		printf("%s is cut short\n", argv[1]);
+		return 1;
+	}
+	fclose(f);
+
+	for (i = 0; i < h.blocks; i++) {
+		if (r[i].chunk == MEM_SNAPSHOT_DIRECT) {
+			direct++;
+			directbytes += r[i].size;
+		} else if (r[i].flags & MEM_SNAPSHOT_ALLOC) {
+			used++;
+			usedbytes += r[i].size;
+		} else {
+			holes++;
+			freebytes += r[i].size;
+			if (r[i].size > largest)
+				largest = r[i].size;
+			for (b = 0; ((size_t) 2 << b) <= r[i].size && b < MEM_HIST_BUCKETS - 1; b++)
+				;
+			hist[b]++;
+		}
+	}
+
+	printf("%s pool of %lu bytes in %u chunks, %lu blocks\n",
+	       h.strategy < sizeof(strategy_names) / sizeof(*strategy_names) ? strategy_names[h.strategy] : "unknown",
+	       (unsigned long) h.total, h.chunks, (unsigned long) h.blocks);
+	printf("%zu bytes allocated in %zu blocks, %zu bytes in %zu direct-mapped blocks\n", usedbytes, used, directbytes, direct);
+	printf("%zu bytes free in %zu holes, largest %zu", freebytes, holes, largest);
+	if (freebytes > 0)
+		printf(", fragmentation (1 - largest/free) %f", 1.0 - (double) largest / freebytes);
+	printf("\n");
+	for (b = 0; b < MEM_HIST_BUCKETS; b++)
+		if (hist[b] > 0)
+			printf("  %10zu+ bytes: %zu holes\n", (size_t) 1 << b, hist[b]);
+
+	/* the blocks of a chunk are next to each other */
+	for (start = 0; start < h.blocks && r[start].chunk != MEM_SNAPSHOT_DIRECT; start = i) {
+		for (i = start; i < h.blocks && r[i].chunk == r[start].chunk; i++)
+			;
+		print_chunk(r + start, i - start, cells);
+	}
+	free(r);
+	return 0;
+}
@@ -5,6 +5,9 @@
 #include <assert.h>
 #include <time.h>
 #include <unistd.h>
+#include <math.h>
+#include <sys/wait.h>
+#include <sys/mman.h>
 
 #include "mymem.h"
 #include "testrunner.h"
@@ -120,6 +123,121 @@ void do_randomized_test(int strategyToUse, int totalSize, float fillRatio, int m
 	}
 }
 
+/* performs a randomized test with heavy-tailed block sizes:
+	sizes follow a Pareto distribution with shape alpha, starting at minBlockSize and
+		cut off at maxBlockSize, so most blocks are small and a few are very large
+	blocks are allocated while fewer than fillRatio * totalSize bytes are live, otherwise one is freed
+	direct == the mem_options.direct threshold; 0 keeps every block in the pool
+	*/
+void do_heavytail_test(int strategyToUse, int totalSize, float fillRatio, double alpha, int minBlockSize, int maxBlockSize, int direct, int iterations)
+{
+	static void * pointers[10000];
+	int storedPointers = 0;
+	int strategy;
+	int lbound = 1;
+	int ubound = 4;
+
+	if (strategyToUse>0)
+		lbound=ubound=strategyToUse;
+
+	FILE *log;
+	log = fopen("tests.log","a");
+	if(log == NULL) {
+	  perror("Can't append to log file.\n");
+	  return;
+	}
+
+	fprintf(log,"Running heavy-tailed tests: pool size == %d, fill ratio == %f, Pareto alpha == %f, block size is from %d to %d, direct threshold == %d, %d iterations\n",totalSize,fillRatio,alpha,minBlockSize,maxBlockSize,direct,iterations);
+
+	fclose(log);
+
+	for (strategy = lbound; strategy <= ubound; strategy++)
+	{
+		struct mem_options opts = {Heap, 0, 0, 0, direct};
+		double sum_largest_free = 0;
+		double sum_holes = 0;
+		double sum_fragmentation = 0;
+		int failed_allocations = 0;
+		struct timespec execstart, execend;
+		int force_free = 0;
+		int i;
+		storedPointers = 0;
+
+		initmem_opts(strategy,totalSize,&opts);
+		srand(strategy);
+
+		clock_gettime(CLOCK_REALTIME, &execstart);
+
+		for (i = 0; i < iterations; i++)
+		{
+			if (!force_free && storedPointers < 10000 && mem_allocated() < totalSize * fillRatio)
+			{
+				double u = (rand() + 1.0) / (RAND_MAX + 2.0);
+				double size = minBlockSize / pow(u, 1.0 / alpha);
+				int newBlockSize = size > maxBlockSize ? maxBlockSize : (int)size;
+				/* allocate */
+				void * pointer = mymalloc(newBlockSize);
+				if (pointer != NULL)
+					pointers[storedPointers++] = pointer;
+				else
+				{
+					failed_allocations++;
+					force_free = 1;
+				}
+			}
+			else if (storedPointers > 0)
+			{
+				/* free */
+				int chosen = rand() % storedPointers;
+				void * pointer = pointers[chosen];
+				pointers[chosen] = pointers[storedPointers-1];
+				storedPointers--;
+				force_free = 0;
+				myfree(pointer);
+			}
+
+			sum_largest_free += mem_largest_free();
+			sum_holes += mem_holes();
+			if (mem_free() > 0)
+				sum_fragmentation += 1.0 - (double)mem_largest_free() / mem_free();
+		}
+
+		clock_gettime(CLOCK_REALTIME, &execend);
+
+		log = fopen("tests.log","a");
+		if(log == NULL) {
+		  perror("Can't append to log file.\n");
+		  return;
+		}
+
+		fprintf(log,"\t=== %s%s ===\n",strategy_name(strategy),direct ? " + direct" : "");
+		fprintf(log,"\tTest took %.2fms.\n", (execend.tv_sec - execstart.tv_sec) * 1000 + (execend.tv_nsec - execstart.tv_nsec) / 1000000.0);
+		fprintf(log,"\tAverage number of holes: %f\n",sum_holes/iterations);
+		fprintf(log,"\tAverage largest free block: %f\n",sum_largest_free/iterations);
+		fprintf(log,"\tAverage fragmentation (1 - largest/free): %f\n",sum_fragmentation/iterations);
+		fprintf(log,"\tDirect-mapped blocks at end: %zu\n",mem_direct_blocks());
+		fprintf(log,"\tFailed allocations: %d\n",failed_allocations);
+		fclose(log);
+	}
+}
+
+/* heavy-tailed workloads with and without the direct-map bypass for huge blocks */
+int do_heavytail_tests(int argc, char **argv)
+{
+	int strategy = strategyFromString(*(argv+1));
+
+	do_heavytail_test(strategy,256<<10,0.5,1.2,16,64<<10,0,5000);
+	do_heavytail_test(strategy,256<<10,0.5,1.2,16,64<<10,8<<10,5000);
+
+	do_heavytail_test(strategy,256<<10,0.75,1.1,32,128<<10,0,5000);
+	do_heavytail_test(strategy,256<<10,0.75,1.1,32,128<<10,16<<10,5000);
+
+	do_heavytail_test(strategy,1<<20,0.9,1.5,128,512<<10,0,5000);
+	do_heavytail_test(strategy,1<<20,0.9,1.5,128,512<<10,32<<10,5000);
+
+	return 0;
+}
+
 /* run randomized tests against the various strategies with various parameters */
 int do_stress_tests(int argc, char **argv)
 {
@@ -152,6 +270,312 @@ int do_stress_tests(int argc, char **argv)
 	return 0; /* you nominally pass for surviving without segfaulting */
 }
 
+/* Read the trace in path into *records and check its header.  Returns
+ * the number of records, or -1. */
+static long read_trace(const char *path, struct mem_trace_record **records)
+{
+	struct mem_trace_header h;
+	FILE *f = fopen(path, "rb");
+	size_t n = 0, cap = 1024;
+
+	if (f == NULL)
+		return -1;
+	if (fread(&h, sizeof(h), 1, f) != 1 || memcmp(h.magic, MEM_TRACE_MAGIC, 8) != 0
+		|| h.version != MEM_TRACE_VERSION || h.record_size != sizeof(struct mem_trace_record))
+	{
+		fclose(f);
+		return -1;
+	}
+	*records = malloc(cap * sizeof(struct mem_trace_record));
+	while (*records != NULL && fread(*records + n, sizeof(struct mem_trace_record), 1, f) == 1)
+		if (++n == cap)
+		{
+			struct mem_trace_record *grown = realloc(*records, (cap *= 2) * sizeof(struct mem_trace_record));
+
+			if (grown == NULL)
+				free(*records);
+			*records = grown;
+		}
+	fclose(f);
+	return *records == NULL ? -1 : (long) n;
+}
+
+/* A trace made ready for replay: every block the trace mentions gets a
+ * slot, so the replay itself only indexes an array.  A block keeps its slot
+ * through myrealloc; a free of a block allocated before the trace started
+ * has slot -1. */
+struct replay
+{
+	struct mem_trace_record *records;
+	long count;
+	int *slot;		/* per record */
+	void **blocks;		/* live replay pointer per slot */
+	long slots;
+	long untracked;		/* frees and reallocs of blocks allocated before the trace started */
+	size_t pool;		/* pool size if the trace does not start with initmem */
+};
+
+struct replay_result
+{
+	double seconds;		/* wall time of a replay without per-call timing */
+	long calls;
+	uint64_t latency[5];	/* ns: median, 90th, 99th, 99.9th percentile and max */
+	double peak_fragmentation;	/* highest 1 - largest free / free */
+	size_t peak_holes;
+	long failed;
+	size_t allocated;	/* bytes allocated when the trace ends */
+};
+
+static int cmp_u64(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *) a, y = *(const uint64_t *) b;
+
+	return x < y ? -1 : x > y;
+}
+
+static uint64_t replay_clock()
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* Give every block in rp->records a slot.  Trace ids are addresses in the
+ * traced process and are reused once freed, so an id means the most recent
+ * block allocated under it; ids map to slots through an open-addressing
+ * table that is overwritten rather than deleted from. */
+static int replay_prepare(struct replay *rp)
+{
+	size_t cap = 16, mask, h;
+	uint64_t *keys;
+	int *values;
+	size_t live = 0, peak = 0, *sizes;
+	long i;
+
+	while (cap < 2 * (size_t) rp->count + 2)
+		cap *= 2;
+	mask = cap - 1;
+	keys = calloc(cap, sizeof(uint64_t));
+	values = malloc(cap * sizeof(int));
+	rp->slot = malloc((rp->count + 1) * sizeof(int));
+	sizes = calloc(rp->count + 1, sizeof(size_t));
+	if (keys == NULL || values == NULL || rp->slot == NULL || sizes == NULL)
+		return -1;
+
+#define REPLAY_FIND(id) \
+	for (h = ((id) * 0x9e3779b97f4a7c15ULL) >> 20 & mask; keys[h] != 0 && keys[h] != (id); h = (h + 1) & mask)
+
+	rp->slots = rp->untracked = 0;
+	for (i = 0; i < rp->count; i++)
+	{
+		struct mem_trace_record *r = &rp->records[i];
+		int s = -1;
+
+		switch (r->op)
+		{
+		case MEM_TRACE_INIT:
+			memset(keys, 0, cap * sizeof(uint64_t));
+			live = 0;
+			break;
+		case MEM_TRACE_MALLOC:
+			s = rp->slots++;
+			if (r->id != 0)
+			{
+				REPLAY_FIND(r->id);
+				keys[h] = r->id;
+				values[h] = s;
+				sizes[s] = r->size;
+				live += r->size;
+			}
+			break;
+		case MEM_TRACE_FREE:
+		case MEM_TRACE_REALLOC:
+			REPLAY_FIND(r->op == MEM_TRACE_FREE ? r->id : r->old_id);
+			if (keys[h] == 0 || values[h] < 0)
+			{
+				rp->untracked++;
+				break;
+			}
+			s = values[h];
+			if (r->op == MEM_TRACE_FREE)
+			{
+				values[h] = -1;
+				live -= sizes[s];
+			}
+			else if (r->id != 0)
+			{
+				values[h] = -1;
+				REPLAY_FIND(r->id);
+				keys[h] = r->id;
+				values[h] = s;
+				live += r->size - sizes[s];
+				sizes[s] = r->size;
+			}
+			break;
+		}
+		rp->slot[i] = s;
+		if (live > peak)
+			peak = live;
+	}
+#undef REPLAY_FIND
+
+	/* a trace started on a running pool: room for twice what it had live */
+	rp->pool = 2 * peak;
+	free(keys);
+	free(values);
+	free(sizes);
+	rp->blocks = calloc(rp->slots + 1, sizeof(void *));
+	return rp->blocks != NULL ? 0 : -1;
+}
+
+/* Replay the calls of record i.  Returns 1 for an allocation that failed. */
+static int replay_call(struct replay *rp, long i, strategies strategy)
+{
+	struct mem_trace_record *r = &rp->records[i];
+	void **b = rp->slot[i] >= 0 ? &rp->blocks[rp->slot[i]] : NULL;
+	void *p;
+
+	switch (r->op)
+	{
+	case MEM_TRACE_INIT:
+		initmem(strategy, r->size);
+		return 0;
+	case MEM_TRACE_MALLOC:
+		*b = mymalloc_hint(r->size, r->lifetime);
+		if (*b != NULL && r->id == 0)
+		{
+			/* failed when traced, so nothing ever frees it */
+			myfree(*b);
+			*b = NULL;
+			return 0;
+		}
+		return *b == NULL;
+	case MEM_TRACE_FREE:
+		if (b != NULL)
+		{
+			myfree(*b);
+			*b = NULL;
+		}
+		return 0;
+	case MEM_TRACE_REALLOC:
+		if (b == NULL || *b == NULL)
+			return 0;
+		p = myrealloc(*b, r->size);
+		if (p == NULL)
+			return 1;
+		*b = p;
+		return 0;
+	}
+	return 0;
+}
+
+/* Replay the whole trace against strategy: once for throughput, then once
+ * more timing every call and sampling the pool after it.  The allocator
+ * sees the same calls in the same order both times, so everything but the
+ * timings is the same from run to run. */
+static int replay_run(struct replay *rp, strategies strategy, struct replay_result *res)
+{
+	static const double pct[4] = {0.5, 0.9, 0.99, 0.999};
+	uint64_t *lat = malloc((rp->count + 1) * sizeof(uint64_t));
+	uint64_t start;
+	long i, n = 0;
+	int k;
+
+	if (lat == NULL)
+		return -1;
+	memset(res, 0, sizeof(*res));
+
+	initmem(strategy, rp->pool);
+	start = replay_clock();
+	for (i = 0; i < rp->count; i++)
+		replay_call(rp, i, strategy);
+	res->seconds = (replay_clock() - start) / 1e9;
+
+	memset(rp->blocks, 0, (rp->slots + 1) * sizeof(void *));
+	initmem(strategy, rp->pool);
+	for (i = 0; i < rp->count; i++)
+	{
+		int op = rp->records[i].op;
+
+		start = replay_clock();
+		res->failed += replay_call(rp, i, strategy);
+		if (op != MEM_TRACE_INIT)
+			lat[n++] = replay_clock() - start;
+
+		if (mem_free() > 0 && 1.0 - (double) mem_largest_free() / mem_free() > res->peak_fragmentation)
+			res->peak_fragmentation = 1.0 - (double) mem_largest_free() / mem_free();
+		if (mem_holes() > res->peak_holes)
+			res->peak_holes = mem_holes();
+	}
+	res->calls = n;
+	res->allocated = mem_allocated();
+
+	qsort(lat, n, sizeof(uint64_t), cmp_u64);
+	for (k = 0; k < 4 && n > 0; k++)
+		res->latency[k] = lat[(long) (pct[k] * (n - 1))];
+	res->latency[4] = n > 0 ? lat[n - 1] : 0;
+	free(lat);
+	return 0;
+}
+
+static void replay_free(struct replay *rp)
+{
+	free(rp->records);
+	free(rp->slot);
+	free(rp->blocks);
+}
+
+/* mem -replay <trace> <strategy|all>: run a trace recorded with
+   mem_trace_start against each strategy and compare them. */
+int do_replay(int argc, char **argv)
+{
+	struct replay rp;
+	struct replay_result res;
+	strategies strategy;
+	int lbound = 1;
+	int ubound = 4;
+
+	if (argc < 3)
+	{
+		printf("Usage: mem -replay <trace> <strategy|all>\n");
+		return 1;
+	}
+	if (strategyFromString(argv[2])>0)
+		lbound=ubound=strategyFromString(argv[2]);
+
+	memset(&rp, 0, sizeof(rp));
+	rp.count = read_trace(argv[1], &rp.records);
+	if (rp.count < 0)
+	{
+		printf("%s is not an allocation trace\n", argv[1]);
+		return 1;
+	}
+	if (replay_prepare(&rp) != 0)
+	{
+		printf("Out of memory preparing %s\n", argv[1]);
+		replay_free(&rp);
+		return 1;
+	}
+	printf("Replaying %s: %ld calls, %ld blocks, %ld calls on blocks from before the trace\n", argv[1], rp.count, rp.slots, rp.untracked);
+
+	for (strategy = lbound; strategy <= ubound; strategy++)
+	{
+		if (replay_run(&rp, strategy, &res) != 0)
+			break;
+		printf("\t=== %s ===\n", strategy_name(strategy));
+		printf("\tThroughput: %.0f calls/s (%.2fms)\n", res.seconds > 0 ? res.calls / res.seconds : 0, res.seconds * 1000);
+		printf("\tLatency (ns): p50 %lu, p90 %lu, p99 %lu, p99.9 %lu, max %lu\n",
+			(unsigned long) res.latency[0], (unsigned long) res.latency[1], (unsigned long) res.latency[2],
+			(unsigned long) res.latency[3], (unsigned long) res.latency[4]);
+		printf("\tPeak fragmentation (1 - largest/free): %f\n", res.peak_fragmentation);
+		printf("\tPeak number of holes: %zu\n", res.peak_holes);
+		printf("\tFailed allocations: %ld\n", res.failed);
+	}
+	replay_free(&rp);
+	return 0;
+}
+
 /* basic sequential allocation of single byte blocks */
 int test_alloc_1(int argc, char **argv) {
 	strategies strategy;
@@ -264,6 +688,8 @@ int test_alloc_2(int argc, char **argv) {
 				correct_largest_free = 88;
 				break;
 		        case NotSet:
+		        case Region:
+		        case Adaptive:
 			        break;
 		}
 
@@ -275,25 +701,25 @@ int test_alloc_2(int argc, char **argv) {
 
 		if (mem_holes() != correct_holes)
 		{
-			printf("Holes counted as %d, should be %d with %s\n", mem_holes(), correct_holes, strategy_name(strategy));
+			printf("Holes counted as %zu, should be %d with %s\n", mem_holes(), correct_holes, strategy_name(strategy));
 			return	1;
 		}
 
 		if (mem_small_free(9) != correct_small)
 		{
-			printf("Small holes counted as %d, should be %d with %s\n", mem_small_free(9), correct_small, strategy_name(strategy));
+			printf("Small holes counted as %zu, should be %d with %s\n", mem_small_free(9), correct_small, strategy_name(strategy));
 			return	1;
 		}
 
 		if (mem_allocated() != correct_alloc)
 		{
-			printf("Memory reported as %d, should be %d with %s\n", mem_allocated(0), correct_alloc, strategy_name(strategy));
+			printf("Memory reported as %zu, should be %d with %s\n", mem_allocated(0), correct_alloc, strategy_name(strategy));
 			return	1;
 		}
 
 		if (mem_largest_free() != correct_largest_free)
 		{
-			printf("Largest memory block free reported as %d, should be %d with %s\n", mem_largest_free(), correct_largest_free, strategy_name(strategy));
+			printf("Largest memory block free reported as %zu, should be %d with %s\n", mem_largest_free(), correct_largest_free, strategy_name(strategy));
 			return	1;
 		}
 
@@ -442,39 +868,2060 @@ int test_alloc_4(int argc, char **argv) {
 }
 
 
-int run_memory_tests(int argc, char **argv)
-{
-	if (argc < 3)
+/* sequential allocation out of an mmap-backed pool, with and without huge pages */
+int test_mmap_1(int argc, char **argv) {
+	strategies strategy;
+	int lbound = 1;
+	int ubound = 4;
+	int flags[] = {0, MEM_HUGE_TRANSPARENT, MEM_HUGE_EXPLICIT, MEM_PREFAULT};
+	size_t sz = 4 << 20;
+
+	if (strategyFromString(*(argv+1))>0)
+		lbound=ubound=strategyFromString(*(argv+1));
+
+	for (strategy = lbound; strategy <= ubound; strategy++)
 	{
-	        printf("Usage: mem -test <test> <strategy> \n");
-		return 0;
+		int f;
+		for (f = 0; f < sizeof(flags)/sizeof(flags[0]); f++)
+		{
+			struct mem_options opts = {Mapped, flags[f]};
+			void* lastPointer = NULL;
+			int i;
+
+			initmem_opts(strategy, sz, &opts);
+			if (mem_pool() == NULL || mem_backing() != Mapped || mem_total() != sz)
+			{
+				printf("Mapped pool with flags %x was not set up with %s\n", flags[f], strategy_name(strategy));
+				return 1;
+			}
+			if ((mem_backing_flags() & MEM_HUGE_TRANSPARENT) && ((size_t)mem_pool() % (2 << 20)) != 0)
+			{
+				printf("Transparent huge page pool %p is not 2 MiB aligned with %s\n", mem_pool(), strategy_name(strategy));
+				return 1;
+			}
+
+			for (i = 0; i < 100; i++)
+			{
+				void* pointer = mymalloc(1000);
+				if ( i > 0 && pointer != (lastPointer+1000) )
+				{
+					printf("Allocation with %s was not sequential at %i; expected %p, actual %p\n", strategy_name(strategy), i,lastPointer+1000,pointer);
+					return 1;
+				}
+				memset(pointer, i, 1000);
+				lastPointer = pointer;
+			}
+
+			if (mem_allocated() != 100000 || mem_free() != sz - 100000)
+			{
+				printf("Mapped pool reports %zu allocated, %zu free with %s\n", mem_allocated(), mem_free(), strategy_name(strategy));
+				return 1;
+			}
+		}
 	}
-	set_testrunner_default_timeout(20);
-	/* Tests can be invoked by matching their name or their suite name or 'all'*/
-	testentry_t tests[] = {
-		{"alloc1","suite1",test_alloc_1},
-		{"alloc2","suite2",test_alloc_2},
-		{"alloc3","suite1",test_alloc_3},
-		{"alloc4","suite2",test_alloc_4},
-		{"stress","suite3",do_stress_tests},
-	};
 
- 	return run_testrunner(argc,argv,tests,sizeof(tests)/sizeof(testentry_t));
+	initmem(First, 100); /* switching back must unmap the old pool */
+	if (mem_backing() != Heap)
+	{
+		printf("initmem did not return to a malloc'ed pool\n");
+		return 1;
+	}
+
+	return 0;
 }
 
-int main(int argc, char **argv)
-{
-  if( argc < 2) {
-    printf("Usage: mem -test <test> <strategy> | mem -try <arg1> <arg2> ... \n");
-    exit(-1);
-  }
-  else if (!strcmp(argv[1],"-test"))
-    return run_memory_tests(argc-1,argv+1);
-  else if (!strcmp(argv[1],"-try")) {
-    try_mymem(argc-1,argv+1);
-    return 0;
-  } else {
-    printf("Usage: mem -test <test> <strategy> | mem -try <arg1> <arg2> ... \n");
+
+/* a growable pool adds chunks when full and never merges across them */
+int test_grow_1(int argc, char **argv) {
+	strategies strategy;
+	int lbound = 1;
+	int ubound = 4;
+
+	if (strategyFromString(*(argv+1))>0)
+		lbound=ubound=strategyFromString(*(argv+1));
+
+	for (strategy = lbound; strategy <= ubound; strategy++)
+	{
+		struct mem_options opts = {Heap, 0, 100};
+		void* pointers[100];
+		void* big;
+		void* small;
+		int i;
+
+		initmem_opts(strategy,100,&opts);
+		for (i = 0; i < 100; i++)
+			pointers[i] = mymalloc(1);
+
+		big = mymalloc(150);   /* larger than the growth step: chunk sized to fit */
+		small = mymalloc(10);  /* pool full again: chunk of the growth step */
+		if (big == NULL || small == NULL || mem_total() != 350)
+		{
+			printf("Pool did not grow to 350 bytes with %s (total %zu)\n", strategy_name(strategy), mem_total());
+			return 1;
+		}
+
+		myfree(pointers[99]);
+		myfree(big);
+
+		if (mem_holes() != 3)
+		{
+			printf("Holes counted as %zu, should be 3 (blocks merged across chunks?) with %s\n", mem_holes(), strategy_name(strategy));
+			return 1;
+		}
+
+		if (mem_allocated() != 109 || mem_free() != 241 || mem_largest_free() != 150)
+		{
+			printf("Grown pool reports %zu allocated, %zu free, %zu largest with %s\n", mem_allocated(), mem_free(), mem_largest_free(), strategy_name(strategy));
+			return 1;
+		}
+	}
+
+	return 0;
+}
+
+
+/* large holes hand their pages back, from myfree or from mem_trim */
+int test_release_1(int argc, char **argv) {
+	strategies strategy;
+	int lbound = 1;
+	int ubound = 4;
+	size_t sz = 16 << 20;
+	size_t big = 4 << 20;
+
+	if (strategyFromString(*(argv+1))>0)
+		lbound=ubound=strategyFromString(*(argv+1));
+
+	for (strategy = lbound; strategy <= ubound; strategy++)
+	{
+		struct mem_options eager = {Mapped, 0, 0, 1 << 20};
+		struct mem_options manual = {Mapped, 0, 0, 0};
+		void* guard;
+		void* block;
+		void* blocks[64];
+		int i;
+
+		/* released from myfree once the merged hole passes the threshold */
+		initmem_opts(strategy, sz, &eager);
+		guard = mymalloc(100);
+		block = mymalloc(big);
+		memset(block, 1, big);
+		if (mem_resident() < big)
+		{
+			printf("Touched block not resident (%zu bytes) with %s\n", mem_resident(), strategy_name(strategy));
+			return 1;
+		}
+		myfree(block);
+		if (mem_resident() >= big || mem_reclaimable() != 0)
+		{
+			printf("myfree kept %zu bytes resident, %zu reclaimable with %s\n", mem_resident(), mem_reclaimable(), strategy_name(strategy));
+			return 1;
+		}
+
+		/* small holes keep their pages until they are merged into a large one */
+		for (i = 0; i < 64; i++)
+		{
+			blocks[i] = mymalloc(10000);
+			memset(blocks[i], 1, 10000);
+		}
+		for (i = 0; i < 64; i += 2)
+			myfree(blocks[i]);
+		for (i = 1; i < 64; i += 2)
+			myfree(blocks[i]);
+		if (mem_reclaimable() != 0)
+		{
+			printf("Merged holes left %zu bytes reclaimable with %s\n", mem_reclaimable(), strategy_name(strategy));
+			return 1;
+		}
+		myfree(guard);
+
+		/* kept until an explicit trim pass */
+		initmem_opts(strategy, sz, &manual);
+		guard = mymalloc(100);
+		block = mymalloc(big);
+		memset(block, 1, big);
+		myfree(block);
+		if (mem_reclaimable() < big - 8192)
+		{
+			printf("Only %zu bytes reclaimable after freeing %zu with %s\n", mem_reclaimable(), big, strategy_name(strategy));
+			return 1;
+		}
+		if (mem_trim(1 << 20) < big - 8192 || mem_reclaimable() != 0)
+		{
+			printf("mem_trim left %zu bytes reclaimable with %s\n", mem_reclaimable(), strategy_name(strategy));
+			return 1;
+		}
+		if (mem_allocated() != 100)
+		{
+			printf("Memory reported as %zu after trim, should be 100 with %s\n", mem_allocated(), strategy_name(strategy));
+			return 1;
+		}
+	}
+
+	return 0;
+}
+
+
+/* blocks above the direct threshold get a mapping of their own */
+int test_direct_1(int argc, char **argv) {
+	strategies strategy;
+	int lbound = 1;
+	int ubound = 4;
+
+	if (strategyFromString(*(argv+1))>0)
+		lbound=ubound=strategyFromString(*(argv+1));
+
+	for (strategy = lbound; strategy <= ubound; strategy++)
+	{
+		struct mem_options opts = {Heap, 0, 0, 0, 1000};
+		void* small;
+		void* huge;
+
+		initmem_opts(strategy,10000,&opts);
+		small = mymalloc(999);
+		huge = mymalloc(5000);
+
+		if (huge == NULL || (huge >= mem_pool() && huge < mem_pool() + 10000) || mem_direct_blocks() != 1)
+		{
+			printf("Block of 5000 bytes was not direct-mapped with %s\n", strategy_name(strategy));
+			return 1;
+		}
+		memset(huge, 1, 5000);
+
+		if (mem_allocated() != 5999 || mem_total() != 15000 || mem_free() != 9001 || mem_holes() != 1)
+		{
+			printf("Stats with a direct map: %zu allocated, %zu total, %zu free with %s\n", mem_allocated(), mem_total(), mem_free(), strategy_name(strategy));
+			return 1;
+		}
+
+		if (!mem_is_alloc(huge) || !mem_is_alloc(huge + 4999) || !mem_is_alloc(small))
+		{
+			printf("Direct-mapped block not reported as allocated with %s\n", strategy_name(strategy));
+			return 1;
+		}
+
+		myfree(huge);
+		if (mem_allocated() != 999 || mem_total() != 10000 || mem_direct_blocks() != 0)
+		{
+			printf("Freeing a direct-mapped block left %zu allocated, %zu total with %s\n", mem_allocated(), mem_total(), strategy_name(strategy));
+			return 1;
+		}
+	}
+
+	return 0;
+}
+
+
+/* tens of GB of blocks in a sparse, lazily committed pool: sizes past 4 GiB must not wrap */
+int test_large_1(int argc, char **argv) {
+	strategies strategy;
+	int lbound = 1;
+	int ubound = 4;
+	size_t gib = (size_t)1 << 30;
+	size_t sz = 64 * gib;
+	size_t blockSize = 192 << 20;
+	int blocks = 256;    /* 48 GiB worth */
+
+	if (strategyFromString(*(argv+1))>0)
+		lbound=ubound=strategyFromString(*(argv+1));
+
+	for (strategy = lbound; strategy <= ubound; strategy++)
+	{
+		struct mem_options opts = {Mapped, 0};
+		static char* pointers[256];
+		char* huge;
+		int i;
+
+		initmem_opts(strategy, sz, &opts);
+		if (mem_pool() == NULL || mem_total() != sz)
+		{
+			printf("Could not reserve a %zu byte pool with %s\n", sz, strategy_name(strategy));
+			return 1;
+		}
+
+		for (i = 0; i < blocks; i++)
+		{
+			pointers[i] = mymalloc(blockSize);
+			if (pointers[i] == NULL || (i > 0 && pointers[i] != pointers[i-1] + blockSize))
+			{
+				printf("Block %d of %zu bytes misplaced with %s\n", i, blockSize, strategy_name(strategy));
+				return 1;
+			}
+			/* touch only the ends so the pool stays sparse */
+			pointers[i][0] = 1;
+			pointers[i][blockSize-1] = 1;
+		}
+
+		if (mem_allocated() != blocks * blockSize || mem_free() != sz - blocks * blockSize
+			|| mem_largest_free() != 16 * gib || mem_holes() != 1)
+		{
+			printf("Large pool reports %zu allocated, %zu free, %zu largest with %s\n", mem_allocated(), mem_free(), mem_largest_free(), strategy_name(strategy));
+			return 1;
+		}
+
+		/* free every other block, then 16 more to merge blocks 64..96 into a 6 GiB hole */
+		for (i = 0; i < blocks; i += 2)
+			myfree(pointers[i]);
+		for (i = 65; i < 96; i += 2)
+			myfree(pointers[i]);
+		if (mem_holes() != 113 || mem_small_free(blockSize) != 111 || mem_largest_free() != 16 * gib)
+		{
+			printf("Large pool reports %zu holes, %zu small, %zu largest with %s\n", mem_holes(), mem_small_free(blockSize), mem_largest_free(), strategy_name(strategy));
+			return 1;
+		}
+
+		/* 5 GiB does not fit an int and only fits the 6 GiB hole or the tail */
+		huge = mymalloc(5 * gib);
+		if (huge == NULL || mem_allocated() != 5 * gib + 112 * blockSize)
+		{
+			printf("5 GiB allocation failed or miscounted (%zu allocated) with %s\n", mem_allocated(), strategy_name(strategy));
+			return 1;
+		}
+		huge[5 * gib - 1] = 1;
+		if ((strategy == Best || strategy == First) && huge != pointers[64])
+		{
+			printf("5 GiB block not placed in the 6 GiB hole with %s\n", strategy_name(strategy));
+			return 1;
+		}
+
+		myfree(huge);
+		for (i = 1; i < blocks; i += 2)
+			myfree(pointers[i]);
+		if (mem_holes() != 1 || mem_free() != sz || mem_largest_free() != sz)
+		{
+			printf("Large pool did not coalesce back to one %zu byte hole with %s\n", sz, strategy_name(strategy));
+			return 1;
+		}
+	}
+
+	return 0;
+}
+
+
+/* a file-backed pool keeps its blocks across a clean detach and an unclean exit */
+int test_file_1(int argc, char **argv) {
+	strategies strategy;
+	int lbound = 1;
+	int ubound = 4;
+
+	if (strategyFromString(*(argv+1))>0)
+		lbound=ubound=strategyFromString(*(argv+1));
+
+	for (strategy = lbound; strategy <= ubound; strategy++)
+	{
+		char path[] = "/tmp/mempoolXXXXXX";
+		void *a, *b, *c;
+		size_t *root;
+		pid_t child;
+		int result;
+
+		close(mkstemp(path));
+
+		result = initmem_file(strategy, 1 << 20, path);
+		if (result != 0 || mem_backing() != FileBacked || mem_total() != 1 << 20)
+		{
+			printf("Could not create a file-backed pool (%d) with %s\n", result, strategy_name(strategy));
+			return 1;
+		}
+		a = mymalloc(100);
+		b = mymalloc(200);
+		c = mymalloc(300);
+		mymalloc(400);
+		myfree(c);
+		strcpy(b, "persistent");
+		*(size_t *)a = b - mem_pool();   /* offsets stay valid wherever the pool is mapped */
+		mem_set_root(a);
+		mem_close();
+
+		result = initmem_file(strategy, 0, path);
+		root = mem_root();
+		if (result != 1 || root == NULL || strcmp(mem_pool() + *root, "persistent"))
+		{
+			printf("Reattached pool (%d) lost its data with %s\n", result, strategy_name(strategy));
+			return 1;
+		}
+		if (mem_holes() != 2 || mem_allocated() != 700 || !mem_is_alloc(mem_pool() + 300 + 300))
+		{
+			printf("Reattached pool reports %zu holes, %zu allocated with %s\n", mem_holes(), mem_allocated(), strategy_name(strategy));
+			return 1;
+		}
+		mem_close();
+
+		/* a process that dies without detaching leaves the pool dirty */
+		child = fork();
+		if (child == 0)
+		{
+			if (initmem_file(strategy, 0, path) != 1 || mymalloc(50) == NULL)
+				_exit(1);
+			_exit(0);
+		}
+		waitpid(child, &result, 0);
+		if (!WIFEXITED(result) || WEXITSTATUS(result) != 0)
+		{
+			printf("Child could not use the file-backed pool with %s\n", strategy_name(strategy));
+			return 1;
+		}
+
+		result = initmem_file(strategy, 0, path);
+		if (result != 2 || mem_allocated() != 750 || mem_recover() != 0)
+		{
+			printf("Pool after unclean exit: result %d, %zu allocated with %s\n", result, mem_allocated(), strategy_name(strategy));
+			return 1;
+		}
+
+		mem_close();
+		unlink(path);
+	}
+
+	return 0;
+}
+
+
+/* one worker process of test_shared_1: random allocs and frees of blocks it
+   fills with its own byte, checking nobody else wrote into them */
+static int shared_worker(int id, char *gift)
+{
+	void* pointers[200];
+	int sizes[200];
+	int stored = 0;
+	int i, j;
+
+	srand(id + 1);
+	if (gift)
+	{
+		if (strcmp(gift, "from parent"))
+			return 1;
+		myfree(gift);
+	}
+
+	for (i = 0; i < 3000 || stored > 0; i++)
+	{
+		if (i < 3000 && stored < 200 && rand() % 2)
+		{
+			int size = 1 + rand() % 256;
+			void* pointer = mymalloc(size);
+			if (pointer == NULL)
+				continue;
+			memset(pointer, id + 1, size);
+			pointers[stored] = pointer;
+			sizes[stored++] = size;
+		}
+		else if (stored > 0)
+		{
+			int chosen = rand() % stored;
+			for (j = 0; j < sizes[chosen]; j++)
+				if (((char *)pointers[chosen])[j] != id + 1)
+					return 1;
+			myfree(pointers[chosen]);
+			pointers[chosen] = pointers[--stored];
+			sizes[chosen] = sizes[stored];
+		}
+	}
+	return 0;
+}
+
+/* several processes allocate from and free into one pool in shared memory */
+int test_shared_1(int argc, char **argv) {
+	strategies strategy;
+	int lbound = 1;
+	int ubound = 4;
+
+	if (strategyFromString(*(argv+1))>0)
+		lbound=ubound=strategyFromString(*(argv+1));
+
+	for (strategy = lbound; strategy <= ubound; strategy++)
+	{
+		char name[64];
+		pid_t children[4];
+		size_t gift;
+		int w, status;
+
+		snprintf(name, sizeof(name), "/memtest-%d-%d", (int)getpid(), strategy);
+		shm_unlink(name);
+		if (initmem_shared(strategy, 1 << 20, name) != 0 || mem_backing() != Shared)
+		{
+			printf("Could not create shared pool %s with %s\n", name, strategy_name(strategy));
+			return 1;
+		}
+
+		gift = mem_offset(mymalloc(64));
+		strcpy(mem_at(gift), "from parent");
+
+		for (w = 0; w < 4; w++)
+		{
+			children[w] = fork();
+			if (children[w] == 0)
+			{
+				/* odd workers attach by name, even ones keep the inherited mapping */
+				if (w % 2 && initmem_shared(strategy, 0, name) != 1)
+					_exit(2);
+				_exit(shared_worker(w, w == 1 ? mem_at(gift) : NULL));
+			}
+		}
+
+		for (w = 0; w < 4; w++)
+		{
+			waitpid(children[w], &status, 0);
+			if (!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+			{
+				printf("Shared pool worker %d failed (status %d) with %s\n", w, status, strategy_name(strategy));
+				shm_unlink(name);
+				return 1;
+			}
+		}
+
+		if (mem_allocated() != 0 || mem_holes() != 1 || mem_largest_free() != 1 << 20)
+		{
+			printf("Shared pool left %zu allocated in %zu holes with %s\n", mem_allocated(), mem_holes(), strategy_name(strategy));
+			shm_unlink(name);
+			return 1;
+		}
+
+		mem_close();
+		shm_unlink(name);
+	}
+
+	return 0;
+}
+
+
+/* mem_reset drops every block but keeps the pool; initmem of the same size reuses it */
+int test_reset_1(int argc, char **argv) {
+	strategies strategy;
+	int lbound = 1;
+	int ubound = 4;
+
+	if (strategyFromString(*(argv+1))>0)
+		lbound=ubound=strategyFromString(*(argv+1));
+
+	for (strategy = lbound; strategy <= ubound; strategy++)
+	{
+		struct mem_options opts = {Heap, 0, 1000, 0, 5000};
+		void* pool;
+		size_t total;
+		int round, i;
+
+		initmem_opts(strategy,10000,&opts);
+		pool = mem_pool();
+
+		for (round = 0; round < 3; round++)
+		{
+			for (i = 0; i < 1000; i++)
+				if (mymalloc(1 + i % 20) == NULL)
+				{
+					printf("Allocation %d failed in round %d with %s\n", i, round, strategy_name(strategy));
+					return 1;
+				}
+			total = mem_total();
+			mymalloc(6000);          /* direct-mapped */
+			for (i = 1; i < 100; i += 2)
+				myfree(mem_pool() + i);
+
+			mem_reset();
+
+			if (mem_pool() != pool || mem_allocated() != 0 || mem_direct_blocks() != 0
+				|| mem_total() != total || mem_largest_free() < 10000)
+			{
+				printf("After reset %d: %zu allocated, %zu total in %zu holes with %s\n", round, mem_allocated(), mem_total(), mem_holes(), strategy_name(strategy));
+				return 1;
+			}
+			if (mymalloc(4000) != pool)     /* only the first chunk is big enough */
+			{
+				printf("First block after reset is not at the start of the pool with %s\n", strategy_name(strategy));
+				return 1;
+			}
+		}
+
+		/* an unchanged size keeps the buffer but drops the grown chunks */
+		initmem_opts(strategy,10000,&opts);
+		if (mem_pool() != pool || mem_total() != 10000 || mem_holes() != 1)
+		{
+			printf("initmem with an unchanged size did not reuse the pool with %s\n", strategy_name(strategy));
+			return 1;
+		}
+	}
+
+	return 0;
+}
+
+
+/* region strategy: bump allocation, myfree does nothing, mem_release frees back to a mark */
+int test_region_1(int argc, char **argv) {
+	struct mem_options opts = {Heap, 0, 500, 0, 0};
+	void *first, *second, *p;
+	size_t outer, inner;
+	int i;
+
+	initmem(Region,1000);
+
+	first = mymalloc(10);
+	second = mymalloc(20);
+	myfree(first);
+	if (first != mem_pool() || second != first+10 || mymalloc(5) != second+20)
+	{
+		printf("Region allocations are not contiguous\n");
+		return 1;
+	}
+	if (mem_allocated() != 35 || mem_free() != 965 || mem_holes() != 1 || !mem_is_alloc(second+5))
+	{
+		printf("Region reports %zu allocated, %zu free in %zu holes\n", mem_allocated(), mem_free(), mem_holes());
+		return 1;
+	}
+
+	outer = mem_mark();
+	for (i = 0; i < 10; i++)
+		mymalloc(50);
+	inner = mem_mark();
+	p = mymalloc(100);
+	mem_release(inner);
+	if (mymalloc(100) != p)
+	{
+		printf("Region did not reuse the bytes after the inner mark\n");
+		return 1;
+	}
+	mem_release(outer);
+	if (mem_allocated() != 35 || mymalloc(965) != second+25 || mymalloc(1) != NULL)
+	{
+		printf("Release to the outer mark left %zu allocated\n", mem_allocated());
+		return 1;
+	}
+	mem_release(outer);
+
+	/* a growing region moves on to new chunks and releases them again */
+	initmem_opts(Region,1000,&opts);
+	first = mymalloc(900);
+	outer = mem_mark();
+	for (i = 0; i < 20; i++)
+		if (mymalloc(200) == NULL)
+		{
+			printf("Growing region failed after %d blocks\n", i);
+			return 1;
+		}
+	if (mem_total() <= 1000 || mem_allocated() != 900 + 20*200)
+	{
+		printf("Growing region has %zu allocated of %zu\n", mem_allocated(), mem_total());
+		return 1;
+	}
+	mem_release(outer);
+	if (mem_allocated() != 900 || mem_largest_free() < 500 || mymalloc(100) != first+900)
+	{
+		printf("Release of a grown region left %zu allocated\n", mem_allocated());
+		return 1;
+	}
+	mem_reset();
+	if (mem_allocated() != 0 || mymalloc(10) != mem_pool())
+	{
+		printf("Reset region still has %zu allocated\n", mem_allocated());
+		return 1;
+	}
+
+	return 0;
+}
+
+
+/* Mix of short-lived blocks (a ring of the 64 most recent) and long-lived
+   ones (replaced at random now and then).  Returns the average number of
+   holes and largest free block over the run. */
+void do_lifetime_run(strategies strategy, int hinted, double *holes, double *largest)
+{
+	void *shortLived[64] = {0};
+	void *longLived[256] = {0};
+	int i, k, samples = 0;
+
+	*holes = *largest = 0;
+	srand(7);
+	initmem(strategy,100000);
+
+	for (i = 0; i < 20000; i++)
+	{
+		k = i % 64;
+		myfree(shortLived[k]);
+		shortLived[k] = mymalloc_hint(1 + rand() % 400, hinted ? ShortLived : AnyLifetime);
+
+		if (i % 10 == 0)
+		{
+			k = rand() % 256;
+			myfree(longLived[k]);
+			longLived[k] = mymalloc_hint(1 + rand() % 200, hinted ? LongLived : AnyLifetime);
+		}
+		if (i % 100 == 99)
+		{
+			*holes += mem_holes();
+			*largest += mem_largest_free();
+			samples++;
+		}
+	}
+	*holes /= samples;
+	*largest /= samples;
+}
+
+/* lifetime hints keep short-lived blocks from fragmenting the pool between long-lived ones */
+int test_hint_1(int argc, char **argv) {
+	strategies strategy;
+	int lbound = 1;
+	int ubound = 4;
+
+	if (strategyFromString(*(argv+1))>0)
+		lbound=ubound=strategyFromString(*(argv+1));
+
+	for (strategy = lbound; strategy <= ubound; strategy++)
+	{
+		double plainHoles, plainLargest, hintHoles, hintLargest;
+		void *low, *high;
+
+		initmem(strategy,1000);
+		high = mymalloc_hint(10, ShortLived);
+		low = mymalloc_hint(10, LongLived);
+		if (low != mem_pool() || high != mem_pool()+990)
+		{
+			printf("Hinted blocks placed at %zu and %zu with %s\n", mem_offset(low), mem_offset(high), strategy_name(strategy));
+			return 1;
+		}
+
+		do_lifetime_run(strategy, 0, &plainHoles, &plainLargest);
+		do_lifetime_run(strategy, 1, &hintHoles, &hintLargest);
+		if (hintHoles >= plainHoles || hintLargest <= plainLargest)
+		{
+			printf("With hints %.1f holes, largest %.0f; without %.1f holes, largest %.0f with %s\n", hintHoles, hintLargest, plainHoles, plainLargest, strategy_name(strategy));
+			return 1;
+		}
+	}
+
+	return 0;
+}
+
+
+/* handle blocks are slid together by mem_compact, a little per call, around pinned and plain blocks */
+int test_compact_1(int argc, char **argv) {
+	strategies strategy;
+	int lbound = 1;
+	int ubound = 4;
+
+	if (strategyFromString(*(argv+1))>0)
+		lbound=ubound=strategyFromString(*(argv+1));
+
+	for (strategy = lbound; strategy <= ubound; strategy++)
+	{
+		mem_handle_t h[9];
+		char *plain, *p;
+		size_t moved;
+		int i, calls;
+
+		initmem(strategy,1000);
+		for (i = 0; i < 9; i++)
+		{
+			h[i] = mem_handle_alloc(100);
+			memset(mem_handle_lock(h[i]), 'a' + i, 100);
+			mem_handle_unlock(h[i]);
+		}
+		plain = mymalloc(100);
+		for (i = 1; i < 9; i += 2)
+			mem_handle_free(h[i]);
+		if (mymalloc(200) != NULL)
+		{
+			printf("Fragmented pool should not have 200 bytes in one piece with %s\n", strategy_name(strategy));
+			return 1;
+		}
+
+		/* h[4] is pinned, so the holes gather on either side of it */
+		mem_handle_lock(h[4]);
+		for (calls = 0; (moved = mem_compact(150)) > 0; calls++)
+			if (moved > 150)
+			{
+				printf("Compaction moved %zu bytes on a budget of 150 with %s\n", moved, strategy_name(strategy));
+				return 1;
+			}
+		if (calls < 2 || mem_holes() != 2)
+		{
+			printf("Compaction around a pinned block took %d calls and left %zu holes with %s\n", calls, mem_holes(), strategy_name(strategy));
+			return 1;
+		}
+		mem_handle_unlock(h[4]);
+
+		while (mem_compact(1000) > 0)
+			;
+		if (mem_holes() != 1 || mem_largest_free() != 400 || !mem_is_alloc(plain))
+		{
+			printf("Compaction left %zu holes, largest %zu with %s\n", mem_holes(), mem_largest_free(), strategy_name(strategy));
+			return 1;
+		}
+		for (i = 0; i < 9; i += 2)
+		{
+			p = mem_handle_lock(h[i]);
+			if (p != mem_pool() + i / 2 * 100 || p[0] != 'a' + i || p[99] != 'a' + i)
+			{
+				printf("Handle %d lost its block in compaction with %s\n", i, strategy_name(strategy));
+				return 1;
+			}
+			mem_handle_unlock(h[i]);
+		}
+		if (mymalloc(400) == NULL)
+		{
+			printf("Compacted pool cannot hand out its free space with %s\n", strategy_name(strategy));
+			return 1;
+		}
+	}
+
+	return 0;
+}
+
+
+/* the background worker merges deferred frees and compacts handle blocks */
+int test_worker_1(int argc, char **argv) {
+	strategies strategy;
+	int lbound = 1;
+	int ubound = 4;
+
+	if (strategyFromString(*(argv+1))>0)
+		lbound=ubound=strategyFromString(*(argv+1));
+
+	for (strategy = lbound; strategy <= ubound; strategy++)
+	{
+		void *blocks[100];
+		mem_handle_t h[50];
+		int i, waited;
+
+		initmem(strategy,10000);
+		if (mem_worker_start(1000) != 0)
+		{
+			printf("Could not start the worker with %s\n", strategy_name(strategy));
+			return 1;
+		}
+
+		for (i = 0; i < 100; i++)
+			blocks[i] = mymalloc(100);
+		for (i = 0; i < 100; i++)
+			myfree(blocks[i]);
+		/* whether or not the worker got to them yet, the frees must add up */
+		if (mymalloc(10000) != mem_pool())
+		{
+			printf("Whole pool not available after freeing everything with %s\n", strategy_name(strategy));
+			return 1;
+		}
+		myfree(mem_pool());
+
+		for (i = 0; i < 50; i++)
+			h[i] = mem_handle_alloc(100);
+		for (i = 1; i < 50; i += 2)
+			mem_handle_free(h[i]);
+		for (waited = 0; waited < 5000 && (mem_holes() != 1 || mem_largest_free() != 7500); waited++)
+			usleep(1000);
+		if (mem_holes() != 1 || mem_largest_free() != 7500)
+		{
+			printf("Worker left %zu holes, largest %zu with %s\n", mem_holes(), mem_largest_free(), strategy_name(strategy));
+			return 1;
+		}
+		mem_worker_stop();
+	}
+
+	return 0;
+}
+
+
+/* quick lists: freed small blocks wait unmerged for a request of their exact size */
+int test_quick_1(int argc, char **argv) {
+	strategies strategy;
+	int lbound = 1;
+	int ubound = 4;
+
+	if (strategyFromString(*(argv+1))>0)
+		lbound=ubound=strategyFromString(*(argv+1));
+
+	for (strategy = lbound; strategy <= ubound; strategy++)
+	{
+		struct mem_options opts = {Heap, 0, 0, 0, 0, 64};
+		void *blocks[50];
+		int i;
+
+		initmem_opts(strategy,1000,&opts);
+		for (i = 0; i < 50; i++)
+			blocks[i] = mymalloc(16);
+		mymalloc(200);
+
+		/* 32 blocks are held, the 33rd finds the list full and everything is merged;
+		   the remaining 17 are held again */
+		for (i = 0; i < 50; i++)
+			myfree(blocks[i]);
+		if (mem_holes() != 18 || mem_largest_free() != 33*16 || mem_allocated() != 200)
+		{
+			printf("Quick lists left %zu holes, largest %zu, %zu allocated with %s\n", mem_holes(), mem_largest_free(), mem_allocated(), strategy_name(strategy));
+			return 1;
+		}
+
+		if (mymalloc(16) != blocks[49])
+		{
+			printf("Request of a held size did not get the last block freed with %s\n", strategy_name(strategy));
+			return 1;
+		}
+
+		/* nothing this large until the held blocks are merged */
+		if (mymalloc(49*16) != mem_pool() || mem_holes() != 0)
+		{
+			printf("Held blocks were not merged when nothing fit with %s\n", strategy_name(strategy));
+			return 1;
+		}
+	}
+
+	return 0;
+}
+
+
+/* Random sizes 1..1000 at half fill, as in the stress tests but with a fixed seed.
+   Returns the average number of holes and of holes up to 16 bytes. */
+void do_class_run(strategies strategy, struct mem_options *opts, double *holes, double *small)
+{
+	void *pointers[1000];
+	int stored = 0;
+	int i;
+
+	*holes = *small = 0;
+	srand(3);
+	initmem_opts(strategy,10000,opts);
+	for (i = 0; i < 10000; i++)
+	{
+		if (mem_free() > 5000)
+		{
+			void *pointer = mymalloc(1 + rand() % 1000);
+			if (pointer != NULL)
+				pointers[stored++] = pointer;
+		}
+		else
+		{
+			int chosen = rand() % stored;
+			myfree(pointers[chosen]);
+			pointers[chosen] = pointers[--stored];
+		}
+		*holes += mem_holes();
+		*small += mem_small_free(16);
+	}
+	*holes /= 10000;
+	*small /= 10000;
+}
+
+/* size classes round requests up and min_split keeps tiny remainders with their block */
+int test_classes_1(int argc, char **argv) {
+	strategies strategy;
+	int lbound = 1;
+	int ubound = 4;
+
+	if (strategyFromString(*(argv+1))>0)
+		lbound=ubound=strategyFromString(*(argv+1));
+
+	for (strategy = lbound; strategy <= ubound; strategy++)
+	{
+		struct mem_options plain = {Heap, 0, 0, 0, 0, 0, 0};
+		struct mem_options split = {Heap, 0, 0, 0, 0, 0, 16};
+		struct mem_options classes = {Heap, MEM_SIZE_CLASSES, 0, 0, 0, 0, 16};
+		double plainHoles, plainSmall, classHoles, classSmall;
+		void *p;
+
+		initmem_opts(strategy,1000,&classes);
+		p = mymalloc(100);
+		if (mem_allocated() != 104 || mem_wasted() != 4)
+		{
+			printf("100 bytes took %zu with %zu wasted with %s\n", mem_allocated(), mem_wasted(), strategy_name(strategy));
+			return 1;
+		}
+		myfree(p);
+		if (mem_wasted() != 0 || mymalloc(1000) != mem_pool())
+		{
+			printf("A request whose class is larger than the pool was refused with %s\n", strategy_name(strategy));
+			return 1;
+		}
+
+		initmem_opts(strategy,1000,&split);
+		mymalloc(990);
+		if (mem_allocated() != 1000 || mem_holes() != 0 || mem_wasted() != 10)
+		{
+			printf("A 10 byte remainder was split off with %s\n", strategy_name(strategy));
+			return 1;
+		}
+
+		do_class_run(strategy, &plain, &plainHoles, &plainSmall);
+		do_class_run(strategy, &classes, &classHoles, &classSmall);
+		if (classHoles >= plainHoles
+			|| ((strategy == Best || strategy == First) && classSmall >= plainSmall))
+		{
+			printf("Size classes gave %.2f holes, %.2f small; without %.2f holes, %.2f small with %s\n", classHoles, classSmall, plainHoles, plainSmall, strategy_name(strategy));
+			return 1;
+		}
+	}
+
+	return 0;
+}
+
+
+/* the adaptive strategy moves to best-fit when the pool fragments, and back once it is whole again */
+int test_adaptive_1(int argc, char **argv) {
+	struct mem_adaptive_stats stats;
+	void *blocks[100];
+	int i;
+
+	initmem(Adaptive,10000);
+	for (i = 0; i < 100; i++)
+		blocks[i] = mymalloc(100);
+	for (i = 0; i < 100; i += 2)
+		myfree(blocks[i]);
+
+	/* 50 holes of 100 bytes: the largest is a sliver of the free space */
+	for (i = 0; i < 3*256; i++)
+		if (mymalloc(1) == NULL)
+		{
+			printf("Adaptive allocation %d failed\n", i);
+			return 1;
+		}
+	mem_adaptive(&stats);
+	if (stats.active != Best || stats.switches != 1 || stats.samples != 3 || stats.periods[Next] != 3)
+	{
+		printf("Fragmented pool: adaptive uses %s after %zu switches in %zu samples\n", strategy_name(stats.active), stats.switches, stats.samples);
+		return 1;
+	}
+
+	/* one sample the other way is not enough to switch back */
+	mem_reset();
+	for (i = 0; i < 256; i++)
+		mymalloc(1);
+	mem_adaptive(&stats);
+	if (stats.active != Best)
+	{
+		printf("Adaptive switched to %s on a single sample\n", strategy_name(stats.active));
+		return 1;
+	}
+	for (i = 0; i < 2*256; i++)
+		mymalloc(1);
+	mem_adaptive(&stats);
+	if (stats.active != Next || stats.switches != 2 || mem_allocated() != 3*256)
+	{
+		printf("Whole pool: adaptive uses %s after %zu switches\n", strategy_name(stats.active), stats.switches);
+		return 1;
+	}
+
+	return 0;
+}
+
+
+/* mem_block_of finds the block around any byte, through splits, merges, growth and compaction */
+int test_lookup_1(int argc, char **argv) {
+	strategies strategy;
+	int lbound = 1;
+	int ubound = 4;
+
+	if (strategyFromString(*(argv+1))>0)
+		lbound=ubound=strategyFromString(*(argv+1));
+
+	for (strategy = lbound; strategy <= ubound; strategy++)
+	{
+		struct mem_options opts = {Heap, 0, 2000, 0, 0, 32};
+		struct mem_block block;
+		char *pointers[200];
+		size_t sizes[200];
+		mem_handle_t h[20];
+		int stored = 0;
+		int i, k;
+		char local;
+
+		srand(11);
+		initmem_opts(strategy,5000,&opts);
+		for (i = 0; i < 5000; i++)
+		{
+			if (stored < 200 && (stored == 0 || rand() % 3 != 0))
+			{
+				sizes[stored] = 1 + rand() % 100;
+				pointers[stored] = mymalloc(sizes[stored]);
+				stored++;
+			}
+			else
+			{
+				k = rand() % stored;
+				myfree(pointers[k]);
+				pointers[k] = pointers[--stored];
+				sizes[k] = sizes[stored];
+			}
+			k = rand() % stored;
+			if (!mem_block_of(pointers[k] + rand() % sizes[k], &block)
+				|| block.base != pointers[k] || block.size != sizes[k] || !block.alloc)
+			{
+				printf("Block of an allocated byte not found at step %d with %s\n", i, strategy_name(strategy));
+				return 1;
+			}
+		}
+		if (mem_is_alloc(&local) || mem_block_of(NULL, &block))
+		{
+			printf("Address outside the pool reported as a block with %s\n", strategy_name(strategy));
+			return 1;
+		}
+
+		initmem(strategy,1000);
+		for (i = 0; i < 20; i++)
+			h[i] = mem_handle_alloc(50);
+		for (i = 0; i < 20; i += 2)
+			mem_handle_free(h[i]);
+		while (mem_compact(1000) > 0)
+			;
+		for (i = 1; i < 20; i += 2)
+		{
+			char *p = mem_handle_lock(h[i]);
+			if (!mem_block_of(p + 49, &block) || block.base != p || block.size != 50)
+			{
+				printf("Compacted handle block not found with %s\n", strategy_name(strategy));
+				return 1;
+			}
+			mem_handle_unlock(h[i]);
+		}
+		if (!mem_block_of(mem_pool() + 999, &block) || block.alloc || block.size != 500
+			|| mem_is_alloc(mem_pool() + 500))
+		{
+			printf("Hole after compaction not found with %s\n", strategy_name(strategy));
+			return 1;
+		}
+	}
+
+	return 0;
+}
+
+
+/* Walk the pool block by block with mem_block_of and check the indexed statistics against it. */
+int check_free_index(strategies strategy, int step)
+{
+	struct mem_block block;
+	size_t counts[MEM_HIST_BUCKETS], walked[MEM_HIST_BUCKETS];
+	size_t holes = 0, free = 0, largest = 0, small = 0;
+	char *p = mem_pool();
+	int i;
+
+	memset(walked, 0, sizeof(walked));
+	while (p < (char *) mem_pool() + mem_total() && mem_block_of(p, &block))
+	{
+		if (!block.alloc)
+		{
+			for (i = 0; (block.size >> i) > 1; i++)
+				;
+			walked[i]++;
+			holes++;
+			free += block.size;
+			small += block.size <= 24;
+			if (block.size > largest)
+				largest = block.size;
+		}
+		p = (char *) block.base + block.size;
+	}
+	mem_free_histogram(counts);
+	if (mem_holes() != holes || mem_free() != free || mem_largest_free() != largest
+		|| mem_small_free(24) != small || mem_allocated() != mem_total() - free
+		|| memcmp(counts, walked, sizeof(counts)) != 0)
+	{
+		printf("Step %d: index says %zu holes, %zu free, largest %zu, %zu small; the pool has %zu, %zu, %zu, %zu with %s\n",
+			step, mem_holes(), mem_free(), mem_largest_free(), mem_small_free(24), holes, free, largest, small, strategy_name(strategy));
+		return 1;
+	}
+	return 0;
+}
+
+/* the free block index and histogram follow every split, merge, quick list and compaction */
+int test_histogram_1(int argc, char **argv) {
+	strategies strategy;
+	int lbound = 1;
+	int ubound = 4;
+
+	if (strategyFromString(*(argv+1))>0)
+		lbound=ubound=strategyFromString(*(argv+1));
+
+	for (strategy = lbound; strategy <= ubound; strategy++)
+	{
+		struct mem_options opts = {Heap, 0, 0, 0, 0, 32};
+		void *pointers[100];
+		mem_handle_t h[50];
+		int stored = 0, handles = 0;
+		int i, k;
+
+		srand(5);
+		initmem_opts(strategy,20000,&opts);
+		if (check_free_index(strategy, -1))
+			return 1;
+		for (i = 0; i < 3000; i++)
+		{
+			switch (rand() % 5)
+			{
+			case 0:
+			case 1:
+				if (stored < 100 && (pointers[stored] = mymalloc_hint(1 + rand() % 200, rand() % 3)) != NULL)
+					stored++;
+				break;
+			case 2:
+				if (stored > 0)
+				{
+					k = rand() % stored;
+					myfree(pointers[k]);
+					pointers[k] = pointers[--stored];
+				}
+				break;
+			case 3:
+				if (handles < 50 && (h[handles] = mem_handle_alloc(1 + rand() % 100)) != 0)
+					handles++;
+				else if (handles > 0)
+					mem_handle_free(h[--handles]);
+				break;
+			case 4:
+				mem_compact(300);
+				break;
+			}
+			if (check_free_index(strategy, i))
+				return 1;
+		}
+	}
+
+	return 0;
+}
+
+
+/* instrumentation counters, when built with -DMEM_INSTRUMENT, and all zero otherwise */
+int test_stats_1(int argc, char **argv) {
+	strategies strategy;
+	int lbound = 1;
+	int ubound = 4;
+	uint64_t t;
+
+	if (strategyFromString(*(argv+1))>0)
+		lbound=ubound=strategyFromString(*(argv+1));
+
+	for (t = 0; t < 100000; t++)
+		if (mem_latency_floor(mem_latency_bucket(t)) > t
+			|| (t > 0 && mem_latency_bucket(t) < mem_latency_bucket(t-1)))
+		{
+			printf("Latency bucket of %lu is %d\n", (unsigned long) t, mem_latency_bucket(t));
+			return 1;
+		}
+
+	for (strategy = lbound; strategy <= ubound; strategy++)
+	{
+		struct mem_stats stats;
+		void *a, *b;
+		size_t calls = 0;
+		int i;
+
+		initmem(strategy,1000);
+		mem_clear_stats();
+		a = mymalloc(100);
+		b = mymalloc(100);
+		mymalloc(100);
+		myfree(b);
+		myfree(a);
+		mymalloc(2000);
+		mem_get_stats(strategy, &stats);
+
+		for (i = 0; i < MEM_LAT_BUCKETS; i++)
+			calls += stats.malloc_ops.latency[i];
+#ifdef MEM_INSTRUMENT
+		if (stats.malloc_ops.calls != 4 || stats.free_ops.calls != 2 || calls != 4
+			|| stats.splits != 3 || stats.merges != 1 || stats.failed != 1
+			|| stats.malloc_ops.visited == 0 || stats.free_ops.visited == 0
+			|| stats.free_ops.visited > 2 * 4)	/* two lookups in a tree of four blocks */
+#else
+		if (stats.malloc_ops.calls != 0 || stats.splits != 0 || calls != 0)
+#endif
+		{
+			printf("Stats: %zu mallocs, %zu frees, %zu splits, %zu merges, %zu failed, %zu visited with %s\n",
+				stats.malloc_ops.calls, stats.free_ops.calls, stats.splits, stats.merges, stats.failed, stats.free_ops.visited, strategy_name(strategy));
+			return 1;
+		}
+	}
+
+	return 0;
+}
+
+
+int test_realloc_1(int argc, char **argv) {
+	strategies strategy;
+	int lbound = 1;
+	int ubound = 4;
+
+	if (strategyFromString(*(argv+1))>0)
+		lbound=ubound=strategyFromString(*(argv+1));
+
+	for (strategy = lbound; strategy <= ubound; strategy++)
+	{
+		struct mem_block block;
+		char *a, *b, *c;
+		int i;
+
+		initmem(strategy,1000);
+		a = mymalloc(100);
+		b = mymalloc(100);
+		memset(a, 'x', 100);
+
+		/* shrinking leaves a hole behind the block, growing takes it back */
+		if (myrealloc(a, 50) != a || !mem_block_of(a, &block) || block.size != 50 || mem_holes() != 2)
+		{
+			printf("Block not shrunk in place with %s\n", strategy_name(strategy));
+			return 1;
+		}
+		if (myrealloc(a, 100) != a || mem_holes() != 1 || myrealloc(b, 300) != b || mem_allocated() != 400)
+		{
+			printf("Block not grown in place with %s\n", strategy_name(strategy));
+			return 1;
+		}
+
+		/* no room after a: it moves, contents and all */
+		c = myrealloc(a, 200);
+		if (c == NULL || c == a || mem_allocated() != 500 || mem_is_alloc(a))
+		{
+			printf("Block not moved with %s\n", strategy_name(strategy));
+			return 1;
+		}
+		for (i = 0; i < 50; i++)
+			if (c[i] != 'x')
+			{
+				printf("Contents lost in move with %s\n", strategy_name(strategy));
+				return 1;
+			}
+
+		if (myrealloc(c, 2000) != NULL || !mem_is_alloc(c) || mem_allocated() != 500)
+		{
+			printf("Failed realloc changed the block with %s\n", strategy_name(strategy));
+			return 1;
+		}
+		if (myrealloc(NULL, 10) == NULL || myrealloc(c, 0) != NULL || mem_allocated() != 310)
+		{
+			printf("NULL block or zero size not handled as mymalloc/myfree with %s\n", strategy_name(strategy));
+			return 1;
+		}
+	}
+
+	return 0;
+}
+
+int test_trace_1(int argc, char **argv) {
+	strategies strategy;
+	int lbound = 1;
+	int ubound = 4;
+
+	if (strategyFromString(*(argv+1))>0)
+		lbound=ubound=strategyFromString(*(argv+1));
+
+	for (strategy = lbound; strategy <= ubound; strategy++)
+	{
+		char path[] = "/tmp/memtraceXXXXXX";
+		struct mem_trace_record *r;
+		void *a, *b, *c, *p;
+		size_t lost;
+		long n;
+		int i;
+
+		close(mkstemp(path));
+		if (mem_trace_start(path) != 0)
+		{
+			printf("Could not start tracing with %s\n", strategy_name(strategy));
+			return 1;
+		}
+		initmem(strategy,1000);
+		a = mymalloc(100);
+		b = mymalloc_hint(50, ShortLived);
+		c = myrealloc(a, 200);
+		myfree(b);
+		mymalloc(5000);
+		lost = mem_trace_stop();
+		mymalloc(10);           // not recorded
+
+		n = read_trace(path, &r);
+		if (lost != 0 || n != 6
+			|| r[0].op != MEM_TRACE_INIT || r[0].size != 1000 || r[0].delta == UINT32_MAX
+			|| r[1].op != MEM_TRACE_MALLOC || r[1].size != 100 || r[1].id != (uintptr_t) a
+			|| r[2].op != MEM_TRACE_MALLOC || r[2].id != (uintptr_t) b || r[2].lifetime != ShortLived
+			|| r[3].op != MEM_TRACE_REALLOC || r[3].size != 200 || r[3].id != (uintptr_t) c
+			|| r[3].old_id != (uintptr_t) a
+			|| r[4].op != MEM_TRACE_FREE || r[4].id != (uintptr_t) b
+			|| r[5].op != MEM_TRACE_MALLOC || r[5].size != 5000 || r[5].id != 0)
+		{
+			printf("Trace has %ld records, %zu lost, not the calls made with %s\n", n, lost, strategy_name(strategy));
+			return 1;
+		}
+		for (i = 0; i < n; i++)
+			if (r[i].strategy != strategy)
+			{
+				printf("Record %d names strategy %d with %s\n", i, r[i].strategy, strategy_name(strategy));
+				return 1;
+			}
+		free(r);
+
+		/* enough calls to go round the ring several times: every one is
+		   either in the file or counted as lost */
+		mem_trace_start(path);
+		initmem(strategy,1000);
+		for (i = 0; i < 100000; i++)
+		{
+			p = mymalloc(1 + i % 100);
+			myfree(p);
+		}
+		lost = mem_trace_stop();
+		n = read_trace(path, &r);
+		if (n < 0 || n + lost != 200001)
+		{
+			printf("Trace has %ld records and %zu lost of 200001 with %s\n", n, lost, strategy_name(strategy));
+			return 1;
+		}
+		free(r);
+		unlink(path);
+	}
+
+	return 0;
+}
+
+
+int test_replay_1(int argc, char **argv) {
+	strategies strategy;
+	int lbound = 1;
+	int ubound = 4;
+
+	if (strategyFromString(*(argv+1))>0)
+		lbound=ubound=strategyFromString(*(argv+1));
+
+	for (strategy = lbound; strategy <= ubound; strategy++)
+	{
+		char path[] = "/tmp/memtraceXXXXXX";
+		struct replay rp;
+		struct replay_result res;
+		char *pointers[100];
+		int stored = 0, failed = 0;
+		size_t allocated;
+		void *early;
+		int i, k;
+
+		/* a random workload, traced */
+		close(mkstemp(path));
+		mem_trace_start(path);
+		initmem(strategy,5000);
+		srand(5);
+		for (i = 0; i < 3000; i++)
+		{
+			k = stored > 0 ? rand() % stored : 0;
+			if (stored < 100 && (stored == 0 || rand() % 2 == 0))
+			{
+				if ((pointers[stored] = mymalloc_hint(1 + rand() % 200, rand() % 3)) != NULL)
+					stored++;
+				else
+					failed++;
+			}
+			else if (rand() % 4 == 0)
+			{
+				char *p = myrealloc(pointers[k], 1 + rand() % 300);
+				if (p != NULL)
+					pointers[k] = p;
+				else
+					failed++;
+			}
+			else
+			{
+				myfree(pointers[k]);
+				pointers[k] = pointers[--stored];
+			}
+		}
+		allocated = mem_allocated();
+		if (mem_trace_stop() != 0)
+		{
+			printf("Records lost with %s\n", strategy_name(strategy));
+			return 1;
+		}
+
+		/* replaying it with the same strategy ends up the same way */
+		memset(&rp, 0, sizeof(rp));
+		rp.count = read_trace(path, &rp.records);
+		if (rp.count != 3001 || replay_prepare(&rp) != 0 || replay_run(&rp, strategy, &res) != 0
+			|| rp.untracked != 0 || res.calls != 3000 || res.failed != failed || res.allocated != allocated
+			|| res.latency[0] > res.latency[4])
+		{
+			printf("Replay of %ld calls: %ld failed for %d, %zu allocated for %zu with %s\n",
+				rp.count, res.failed, failed, res.allocated, allocated, strategy_name(strategy));
+			return 1;
+		}
+		replay_free(&rp);
+
+		/* a trace started on a running pool */
+		early = mymalloc(10);
+		mem_trace_start(path);
+		mymalloc(100);
+		myfree(early);
+		mem_trace_stop();
+		memset(&rp, 0, sizeof(rp));
+		rp.count = read_trace(path, &rp.records);
+		if (rp.count != 2 || replay_prepare(&rp) != 0 || replay_run(&rp, strategy, &res) != 0
+			|| rp.untracked != 1 || rp.pool != 200 || res.failed != 0 || res.allocated != 100)
+		{
+			printf("Replay of a trace without initmem went wrong with %s\n", strategy_name(strategy));
+			return 1;
+		}
+		replay_free(&rp);
+		unlink(path);
+	}
+
+	return 0;
+}
+
+
+int test_verify_1(int argc, char **argv) {
+	strategies strategy;
+	int lbound = 1;
+	int ubound = 4;
+
+	if (strategyFromString(*(argv+1))>0)
+		lbound=ubound=strategyFromString(*(argv+1));
+
+	for (strategy = lbound; strategy <= ubound; strategy++)
+	{
+		struct mem_options opts = {Heap, MEM_SIZE_CLASSES, 2000, 0, 1500, 32, 8};
+		char *pointers[200];
+		int stored = 0;
+		int i, k, result;
+
+		srand(13);
+		initmem_opts(strategy,5000,&opts);
+		for (i = 0; i < 4000; i++)
+		{
+			k = stored > 0 ? rand() % stored : 0;
+			if (stored < 200 && (stored == 0 || rand() % 2 == 0))
+				pointers[stored++] = mymalloc(1 + rand() % 2000);
+			else if (rand() % 4 == 0)
+				pointers[k] = myrealloc(pointers[k], 1 + rand() % 300);
+			else
+			{
+				myfree(pointers[k]);
+				pointers[k] = pointers[--stored];
+			}
+			if ((result = mem_verify(16)) != 0 || (i % 100 == 0 && (result = mem_verify(0)) != 0))
+			{
+				printf("Verify found problem %d at step %d with %s\n", result, i, strategy_name(strategy));
+				return 1;
+			}
+		}
+		if ((result = mem_verify(0)) != 0)
+		{
+			printf("Verify found problem %d at the end with %s\n", result, strategy_name(strategy));
+			return 1;
+		}
+	}
+
+	initmem(Region,1000);
+	mymalloc(100);
+	mem_release(mem_mark());
+	mymalloc(2000);
+	if (mem_verify(0) != 0 || mem_verify(1) != 0)
+	{
+		printf("Verify found a problem with a region\n");
+		return 1;
+	}
+
+	return 0;
+}
+
+
+/* mem_verify has to tell blocks left unmerged on a quick list from two free
+ * blocks that nothing will merge.  Only a build with MEM_INSTRUMENT can make
+ * the second, through mem_test_set_alloc. */
+int test_verify_2(int argc, char **argv) {
+	strategies strategy;
+	int lbound = 1;
+	int ubound = 4;
+
+	if (strategyFromString(*(argv+1))>0)
+		lbound=ubound=strategyFromString(*(argv+1));
+
+	for (strategy = lbound; strategy <= ubound; strategy++)
+	{
+		struct mem_options opts = {Heap, 0, 0, 0, 0, 32, 0};
+		char *b, *c, *d, *e;
+		int adjacent = MEM_VERIFY_ADJACENT, fixed, held;
+
+		initmem_opts(strategy,5000,&opts);
+		mymalloc(1001);
+		b = mymalloc(2002);
+		c = mymalloc(500);
+		d = mymalloc(16);
+		e = mymalloc(16);
+		myfree(c);		// merged: its neighbours are allocated
+		myfree(d);		// held on the quick list for 16 bytes
+
+#ifdef MEM_INSTRUMENT
+		/* b now free next to c, and not held */
+		if (!mem_test_set_alloc(b, 0))
+		{
+			printf("Could not mark the second block free with %s\n", strategy_name(strategy));
+			return 1;
+		}
+		adjacent = mem_verify(0);
+		mem_test_set_alloc(b, 1);
+#else
+		if (mem_test_set_alloc(b, 0))
+		{
+			printf("The test hook works without MEM_INSTRUMENT with %s\n", strategy_name(strategy));
+			return 1;
+		}
+#endif
+		fixed = mem_verify(0);
+		myfree(e);		// held next to d and the free end of the pool
+		held = mem_verify(0);
+		if (adjacent != MEM_VERIFY_ADJACENT || fixed != 0 || held != 0)
+		{
+			printf("Verify found %d, %d and %d with %s\n", adjacent, fixed, held, strategy_name(strategy));
+			return 1;
+		}
+	}
+	return 0;
+}
+
+/* Poll the statistics published as name until they have seen updates
+ * changes; every copy has to add up. */
+static int export_reader(const char *name, uint64_t updates)
+{
+	const struct mem_shared_stats *seg;
+	struct mem_shared_stats copy;
+	int polls;
+
+	for (polls = 0; (seg = mem_export_open(name)) == NULL; polls++)
+	{
+		if (polls == 1000)
+			return 1;
+		usleep(1000);
+	}
+	for (polls = 0; polls < 10000000; polls++)
+	{
+		if (mem_export_read(seg, &copy) != 0)
+			continue;
+		if (copy.allocated + copy.free != copy.total || copy.holes > copy.malloc_calls + 1)
+			return 1;
+		if (copy.updates >= updates)
+			return 0;
+	}
+	return 1;
+}
+
+int test_export_1(int argc, char **argv) {
+	strategies strategy;
+	int lbound = 1;
+	int ubound = 4;
+
+	if (strategyFromString(*(argv+1))>0)
+		lbound=ubound=strategyFromString(*(argv+1));
+
+	for (strategy = lbound; strategy <= ubound; strategy++)
+	{
+		const struct mem_shared_stats *seg;
+		struct mem_shared_stats copy;
+		uint64_t calls = 0;
+		char name[64];
+		void *a, *b, *pointers[50] = {0};
+		pid_t child;
+		int i, status;
+
+		snprintf(name, sizeof(name), "/memexport-%d-%d", (int)getpid(), strategy);
+		shm_unlink(name);
+		if (mem_export_start(name) != 0 || (seg = mem_export_open(name)) == NULL)
+		{
+			printf("Could not publish statistics as %s with %s\n", name, strategy_name(strategy));
+			return 1;
+		}
+
+		initmem(strategy,1000);
+		a = mymalloc(100);
+		b = mymalloc(200);
+		myfree(a);
+		mymalloc(5000);
+		myrealloc(b, 300);
+		for (i = 0; i < MEM_LAT_BUCKETS; i++)
+			calls += seg->malloc_latency[i] + seg->free_latency[i];
+		if (mem_export_read(seg, &copy) != 0 || copy.strategy != strategy
+			|| copy.allocated != mem_allocated() || copy.free != mem_free() || copy.holes != mem_holes()
+			|| copy.largest_free != mem_largest_free() || copy.total != mem_total()
+			|| copy.malloc_calls != 3 || copy.free_calls != 1 || copy.realloc_calls != 1 || copy.failed != 1
+#ifdef MEM_INSTRUMENT
+			|| !copy.latency || calls != 4)
+#else
+			|| copy.latency || calls != 0)
+#endif
+		{
+			printf("Published %lu allocated, %lu holes, %lu mallocs, %lu failed with %s\n",
+				(unsigned long) copy.allocated, (unsigned long) copy.holes,
+				(unsigned long) copy.malloc_calls, (unsigned long) copy.failed, strategy_name(strategy));
+			return 1;
+		}
+		mem_export_close(seg);
+
+		/* a reader in another process, polling while the pool changes */
+		child = fork();
+		if (child == 0)
+			_exit(export_reader(name, copy.updates + 20000));
+		for (i = 0; i < 20000; i++)
+		{
+			int k = i % 50;
+			if (pointers[k] != NULL)
+			{
+				myfree(pointers[k]);
+				pointers[k] = NULL;
+			}
+			else
+				pointers[k] = mymalloc(1 + i % 40);
+		}
+		waitpid(child, &status, 0);
+		mem_export_stop();
+		shm_unlink(name);
+		if (!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+		{
+			printf("Reader saw inconsistent statistics with %s\n", strategy_name(strategy));
+			return 1;
+		}
+	}
+
+	return 0;
+}
+
+
+/* Read the totals from the heap profile in path: live and ever-sampled
+ * blocks and bytes.  Returns the sampling rate, or 0 if the header is not
+ * there. */
+static size_t read_profile(const char *path, size_t *totals)
+{
+	FILE *f = fopen(path, "r");
+	size_t rate = 0;
+	char line[256];
+	int maps = 0;
+
+	if (f == NULL)
+		return 0;
+	if (fscanf(f, "heap profile: %zu: %zu [%zu: %zu] @ heap_v2/%zu\n",
+		&totals[0], &totals[1], &totals[2], &totals[3], &rate) != 5)
+		rate = 0;
+	while (fgets(line, sizeof(line), f) != NULL)
+		if (strcmp(line, "MAPPED_LIBRARIES:\n") == 0)
+			maps = 1;
+	fclose(f);
+	return maps ? rate : 0;
+}
+
+int test_profile_1(int argc, char **argv) {
+	strategies strategy;
+	int lbound = 1;
+	int ubound = 4;
+
+	if (strategyFromString(*(argv+1))>0)
+		lbound=ubound=strategyFromString(*(argv+1));
+
+	for (strategy = lbound; strategy <= ubound; strategy++)
+	{
+		struct mem_options opts = {Heap, 0, 0, 0, 4000};
+		char path[] = "/tmp/memprofXXXXXX";
+		size_t totals[4];
+		void *pointers[400];
+		int i, sampled;
+
+		close(mkstemp(path));
+		initmem_opts(strategy,100000,&opts);
+
+		/* every allocation is sampled at rate 1 */
+		mem_profile_start(1);
+		for (i = 0; i < 50; i++)
+			pointers[i] = mymalloc(i < 49 ? 100 : 5000);
+		for (i = 0; i < 50; i += 2)
+			myfree(pointers[i]);
+		pointers[1] = myrealloc(pointers[1], 150);
+		if (mem_profile_dump(path) != 0 || read_profile(path, totals) != 1
+			|| totals[0] != 25 || totals[1] != 24 * 100 + 50 + 5000
+			|| totals[2] != 50 || totals[3] != 49 * 100 + 5000)
+		{
+			printf("Profile at rate 1 has %zu: %zu [%zu: %zu] with %s\n",
+				totals[0], totals[1], totals[2], totals[3], strategy_name(strategy));
+			return 1;
+		}
+
+		/* at rate 1000, about one block of 100 bytes in ten */
+		initmem_opts(strategy,100000,&opts);
+		mem_profile_start(1000);
+		for (i = 0; i < 400; i++)
+			pointers[i] = mymalloc(100);
+		if (mem_profile_dump(path) != 0 || read_profile(path, totals) != 1000
+			|| totals[0] < 10 || totals[0] > 100 || totals[1] != totals[0] * 100 || totals[2] != totals[0])
+		{
+			printf("Profile at rate 1000 has %zu: %zu [%zu: %zu] with %s\n",
+				totals[0], totals[1], totals[2], totals[3], strategy_name(strategy));
+			return 1;
+		}
+		sampled = totals[0];
+		for (i = 0; i < 400; i++)
+			myfree(pointers[i]);
+		if (mem_profile_dump(path) != 0 || read_profile(path, totals) != 1000
+			|| totals[0] != 0 || totals[1] != 0 || totals[2] != sampled)
+		{
+			printf("Freed blocks still in the profile with %s\n", strategy_name(strategy));
+			return 1;
+		}
+
+		/* off again: nothing more is sampled */
+		mem_profile_stop();
+		mymalloc(100);
+		if (mem_profile_dump(path) != 0 || read_profile(path, totals) != 0 || totals[2] != 0)
+		{
+			printf("Profile kept sampling after mem_profile_stop with %s\n", strategy_name(strategy));
+			return 1;
+		}
+		unlink(path);
+	}
+
+	return 0;
+}
+
+
+struct pressure_log
+{
+	int kinds[20];		/* kind, negative when pressure ended */
+	int count;
+	void *evict;		/* freed by the callback when allocated bytes run high */
+};
+
+static void log_pressure(const struct mem_pressure *event, void *ctx)
+{
+	struct pressure_log *log = ctx;
+
+	if (log->count < 20)
+		log->kinds[log->count] = event->high ? event->kind : -event->kind;
+	log->count++;
+	if (event->kind == MEM_PRESSURE_ALLOC && event->high && log->evict != NULL)
+	{
+		myfree(log->evict);
+		log->evict = NULL;
+	}
+}
+
+int test_watch_1(int argc, char **argv) {
+	strategies strategy;
+	int lbound = 1;
+	int ubound = 4;
+
+	if (strategyFromString(*(argv+1))>0)
+		lbound=ubound=strategyFromString(*(argv+1));
+
+	for (strategy = lbound; strategy <= ubound; strategy++)
+	{
+		struct mem_watermarks marks = {600, 300, 0.5, 0.2, 0};
+		struct mem_watermarks slow = {600, 300, 0, 0, 60000};
+		struct pressure_log log = {{0}}, rare = {{0}};
+		void *pointers[10];
+		int id, rid, i;
+
+		initmem(strategy,1000);
+		id = mem_watch(&marks, log_pressure, &log);
+		rid = mem_watch(&slow, log_pressure, &rare);
+		for (i = 0; i < 10; i++)
+			pointers[i] = mymalloc(100);
+		if (log.count != 1 || log.kinds[0] != MEM_PRESSURE_ALLOC)
+		{
+			printf("%d events reported on filling the pool with %s\n", log.count, strategy_name(strategy));
+			return 1;
+		}
+
+		/* five holes of 100: fragmented, but still above the low mark */
+		for (i = 0; i < 10; i += 2)
+			myfree(pointers[i]);
+		if (log.count != 2 || log.kinds[1] != MEM_PRESSURE_FRAG)
+		{
+			printf("Fragmentation not reported with %s\n", strategy_name(strategy));
+			return 1;
+		}
+		for (i = 1; i < 10; i += 2)
+			myfree(pointers[i]);
+		if (log.count != 4 || log.kinds[2] != -MEM_PRESSURE_ALLOC || log.kinds[3] != -MEM_PRESSURE_FRAG)
+		{
+			printf("End of pressure not reported with %s\n", strategy_name(strategy));
+			return 1;
+		}
+
+		/* a second time round: the slow watcher has to wait its minute */
+		for (i = 0; i < 7; i++)
+			pointers[i] = mymalloc(100);
+		if (log.count != 5 || rare.count != 1)
+		{
+			printf("Interval not kept (%d and %d events) with %s\n", log.count, rare.count, strategy_name(strategy));
+			return 1;
+		}
+		mem_unwatch(rid);
+
+		/* a callback that frees memory itself */
+		for (i = 0; i < 6; i++)
+			myfree(pointers[i]);
+		log.evict = pointers[6];
+		pointers[0] = mymalloc(300);
+		pointers[1] = mymalloc(300);
+		if (log.evict != NULL || mem_allocated() != 600 || log.count > 20)
+		{
+			printf("Callback could not free memory (%d events, %zu allocated) with %s\n",
+				log.count, mem_allocated(), strategy_name(strategy));
+			return 1;
+		}
+		i = log.count;
+		mem_unwatch(id);
+		mymalloc(300);
+		if (log.count != i)
+		{
+			printf("Events after mem_unwatch with %s\n", strategy_name(strategy));
+			return 1;
+		}
+	}
+
+	return 0;
+}
+
+
+struct walk_log
+{
+	struct mem_block blocks[20];
+	int count;
+	int stop;		/* stop after this many, 0 = never */
+};
+
+static int log_block(const struct mem_block *block, void *ctx)
+{
+	struct walk_log *log = ctx;
+
+	if (log->count < 20)
+		log->blocks[log->count] = *block;
+	log->count++;
+	return log->count == log->stop;
+}
+
+int test_walk_1(int argc, char **argv) {
+	strategies strategy;
+	int lbound = 1;
+	int ubound = 4;
+
+	if (strategyFromString(*(argv+1))>0)
+		lbound=ubound=strategyFromString(*(argv+1));
+
+	for (strategy = lbound; strategy <= ubound; strategy++)
+	{
+		struct mem_options opts = {Heap, 0, 0, 0, 4000};
+		char path[] = "/tmp/memsnapXXXXXX";
+		struct mem_snapshot_header h;
+		struct mem_snapshot_block r;
+		struct walk_log log = {{{0}}}, part = {{{0}}};
+		void *a[6], *big;
+		size_t sum = 0;
+		int fd, i;
+
+		initmem_opts(strategy,1000,&opts);
+		for (i = 0; i < 6; i++)
+			a[i] = mymalloc(100);
+		myfree(a[1]);
+		myfree(a[4]);
+		big = mymalloc(5000);
+
+		/* 4 allocated, 2 holes and the free tail, then the direct block */
+		if (mem_walk(log_block, &log) != 8 || log.count != 8 || log.blocks[0].base != a[0]
+			|| log.blocks[1].alloc || !log.blocks[2].alloc || log.blocks[7].base != big)
+		{
+			printf("Walk saw %d blocks with %s\n", log.count, strategy_name(strategy));
+			return 1;
+		}
+		for (i = 0; i < 7; i++)
+			sum += log.blocks[i].size;
+		part.stop = 3;
+		if (sum != 1000 || mem_walk(log_block, &part) != 3)
+		{
+			printf("Walk did not cover the pool or did not stop with %s\n", strategy_name(strategy));
+			return 1;
+		}
+
+		fd = mkstemp(path);
+		if (mem_snapshot(fd) != 0 || lseek(fd, 0, SEEK_SET) != 0
+			|| read(fd, &h, sizeof(h)) != sizeof(h) || memcmp(h.magic, MEM_SNAPSHOT_MAGIC, 8) != 0
+			|| h.blocks != 8 || h.total != 6000 || h.strategy != strategy || h.chunks != 1)
+		{
+			printf("Snapshot header wrong with %s\n", strategy_name(strategy));
+			return 1;
+		}
+		/* the same blocks as the walk */
+		for (i = 0; i < 8; i++)
+		{
+			char *base;
+
+			if (read(fd, &r, sizeof(r)) != sizeof(r))
+				break;
+			base = r.chunk == MEM_SNAPSHOT_DIRECT ? (char *) (uintptr_t) r.offset : (char *) mem_pool() + r.offset;
+			if (base != log.blocks[i].base || r.size != log.blocks[i].size
+				|| !(r.flags & MEM_SNAPSHOT_ALLOC) != !log.blocks[i].alloc)
+				break;
+		}
+		close(fd);
+		unlink(path);
+		if (i < 8)
+		{
+			printf("Snapshot record %d wrong with %s\n", i, strategy_name(strategy));
+			return 1;
+		}
+	}
+
+	return 0;
+}
+
+
+int run_memory_tests(int argc, char **argv)
+{
+	if (argc < 3)
+	{
+	        printf("Usage: mem -test <test> <strategy> \n");
+		return 0;
+	}
+	set_testrunner_default_timeout(20);
+	/* Tests can be invoked by matching their name or their suite name or 'all'*/
+	testentry_t tests[] = {
+		{"alloc1","suite1",test_alloc_1},
+		{"alloc2","suite2",test_alloc_2},
+		{"alloc3","suite1",test_alloc_3},
+		{"alloc4","suite2",test_alloc_4},
+		{"mmap1","suite4",test_mmap_1},
+		{"grow1","suite4",test_grow_1},
+		{"release1","suite4",test_release_1},
+		{"direct1","suite4",test_direct_1},
+		{"large1","suite4",test_large_1},
+		{"file1","suite4",test_file_1},
+		{"shared1","suite4",test_shared_1},
+		{"reset1","suite4",test_reset_1},
+		{"region1","suite4",test_region_1},
+		{"hint1","suite4",test_hint_1},
+		{"compact1","suite4",test_compact_1},
+		{"worker1","suite4",test_worker_1},
+		{"quick1","suite4",test_quick_1},
+		{"classes1","suite4",test_classes_1},
+		{"adaptive1","suite4",test_adaptive_1},
+		{"lookup1","suite4",test_lookup_1},
+		{"histogram1","suite4",test_histogram_1},
+		{"stats1","suite4",test_stats_1},
+		{"realloc1","suite4",test_realloc_1},
+		{"trace1","suite4",test_trace_1},
+		{"replay1","suite4",test_replay_1},
+		{"walk1","suite4",test_walk_1},
+		{"verify1","suite4",test_verify_1},
+		{"verify2","suite4",test_verify_2},
+		{"export1","suite4",test_export_1},
+		{"profile1","suite4",test_profile_1},
+		{"watch1","suite4",test_watch_1},
+		{"stress","suite3",do_stress_tests},
+		{"heavytail","suite3",do_heavytail_tests},
+	};
+
+ 	return run_testrunner(argc,argv,tests,sizeof(tests)/sizeof(testentry_t));
+}
+
+int main(int argc, char **argv)
+{
+  if( argc < 2) {
+    printf("Usage: mem -test <test> <strategy> | mem -try <arg1> <arg2> ... | mem -replay <trace> <strategy|all>\n");
+    exit(-1);
+  }
+  else if (!strcmp(argv[1],"-test"))
+    return run_memory_tests(argc-1,argv+1);
+  else if (!strcmp(argv[1],"-try")) {
+    try_mymem(argc-1,argv+1);
+    return 0;
+  }
+  else if (!strcmp(argv[1],"-replay"))
+    return do_replay(argc-1,argv+1);
+  else {
+    printf("Usage: mem -test <test> <strategy> | mem -try <arg1> <arg2> ... | mem -replay <trace> <strategy|all>\n");
     exit(-1);
   }
 
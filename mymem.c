@@ -4,34 +4,852 @@
 #include <assert.h>
 #include "mymem.h"
 #include <time.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <pthread.h>
+#include <math.h>
+#include <execinfo.h>
+#if defined(MEM_INSTRUMENT) && (defined(__x86_64__) || defined(__i386__))
+#include <x86intrin.h>
+#endif
+
+#define HUGE_PAGE_SIZE ((size_t)2 << 20)
+#define ROUND_UP(x, a) (((x) + (a) - 1) / (a) * (a))
 
 
 /* The main structure for implementing memory allocation.
  * You may change this to fit your implementation.
  */
 
+typedef uint32_t node_t;        // index of a memoryList in the node slab
+#define NIL ((node_t) 0)        // slot 0 is never used, so 0 means "no node"
+
 struct memoryList
 {
-  // doubly-linked list
-  struct memoryList *last;
-  struct memoryList *next;
+  // doubly-linked list, as slab indices rather than pointers so that the
+  // list means the same thing wherever the slab happens to be mapped
+  node_t last;
+  node_t next;
 
-  int size;            // How many bytes in this block?
+  size_t size;         // How many bytes in this block?
+  size_t offset;       // location of block in its chunk.
   char alloc;          // 1 if this block is allocated,
                        // 0 if this block is free.
-  void *ptr;           // location of block in memory pool.
+  char held;           // 1 if the free block was left unmerged: it waits on a
+                       // quick list or the worker's queue, or is what is left
+                       // of such a block
+  char released;       // 1 if the interior pages of the free block were given
+                       // back and nothing has touched them since
+  int chunk;           // index in chunks[] of the chunk holding the block
+  node_t handle;       // slot in the handle table if mem_compact may move the
+                       // block, 0 if not
+  node_t sample;       // slot in the profiler's sample table if the block was
+                       // sampled, 0 if not
+  size_t slack;        // bytes of an allocated block beyond what was asked for
+
+  // children in the address index, see tree_insert
+  node_t left;
+  node_t right;
+
+  // children and subtree size in the index of free blocks, see free_add
+  node_t sleft;
+  node_t sright;
+  node_t count;
 };
 
-strategies myStrategy = Best;    // Current strategy
+/* Block nodes live in one array, the node slab, and refer to each other by
+ * index.  Nodes unlinked by myfree go on a free list threaded through next.
+ * For a private pool the slab is malloc'ed and doubles when full; for a
+ * file-backed pool it sits at a fixed size inside the mapping, right after
+ * the header, so that the block list persists with the data.
+ */
+#define NODE(i)  ((i) != NIL ? &slab[i] : NULL)
+#define INDEX(n) ((node_t) ((n) - slab))
+#define NEXT(n)  NODE((n)->next)
+#define LAST(n)  NODE((n)->last)
+#define PTR(n)   ((char *) chunks[(n)->chunk].base + (n)->offset)
+
+#define MEM_MAGIC   0x4c4f4f504d454d59ULL  // "YMEMPOOL"
+#define MEM_VERSION 9
+
+/* Allocator state that has to survive with the pool.  Private pools keep it
+ * in localHeader; file-backed pools keep it at the start of the mapping.
+ */
+struct memHeader
+{
+  uint64_t magic;
+  uint32_t version;
+  uint32_t dirty;      // nonzero while a process has the pool attached
+  size_t length;       // of the whole mapping
+  void *base;          // address the mapping was last attached at
+  size_t slab_offset;  // where the node slab starts in the mapping
+  size_t pool_offset;  // where chunk 0 starts in the mapping
+  size_t pool_size;    // bytes in chunk 0
+  size_t root;         // offset of the root block in chunk 0, plus one; 0 = none
+  node_t slab_cap;     // nodes the slab has room for
+  node_t slab_used;    // nodes [1, slab_used) have been handed out
+  node_t free_nodes;   // recycled nodes, chained through next
+  node_t head;         // first block
+  node_t rover;        // next-fit: where the next search starts; region: the free block being bumped into, NIL when full
+  node_t tree;         // root of the address index
+  node_t free_tree;    // root of the index of free blocks by size
+  size_t free_bytes;   // in free blocks
+  size_t histogram[MEM_HIST_BUCKETS];  // free blocks by floor(log2(size))
+  uint32_t broken;     // a dead lock owner left the list beyond repair
+  pthread_mutex_t lock;  // process-shared and robust; only used by shared pools
+};
 
+/* The pool is one or more chunks.  Chunk 0 is the pool initmem set up; the
+ * rest are added by grow_pool when nothing fits.  Each chunk's blocks form
+ * one contiguous, address-ordered run of the block list, and blocks are
+ * never merged across a chunk boundary.
+ */
+#define MAX_CHUNKS 64
+
+struct memChunk
+{
+  void *base;
+  size_t size;         // usable bytes
+  size_t mapped;       // length of the mapping, 0 if malloc'ed
+  int flags;           // MEM_* flags that actually took effect for the chunk
+};
+
+#define CHUNK_EXTERNAL 0x100    // chunk lives inside a file mapping, not ours to free
+
+/* Requests of at least myDirect bytes bypass the pool and get a mapping of
+ * their own, so one huge block neither splits the pool nor pays for a list
+ * search.  They are few and large, so a flat table searched linearly is
+ * plenty to find them again in myfree.
+ */
+struct directMap
+{
+  void *ptr;
+  size_t size;         // bytes requested
+  size_t mapped;       // length of the mapping
+  node_t sample;       // as for a block
+};
 
-size_t mySize;
-void *myMemory = NULL;
+strategies myStrategy = Best;    // Current strategy
 
-static struct memoryList *head;
-static struct memoryList *next;
+/* The Adaptive strategy runs one of the four search paths and reconsiders
+ * which one every ADAPT_PERIOD allocations, from a sample of the free-size
+ * index that takes O(log n).
+ * It only switches once ADAPT_CONFIRM samples in a row agree on another
+ * path, so a workload near a threshold does not make it flip back and forth.
+ */
+#define ADAPT_PERIOD  256
+#define ADAPT_CONFIRM 3
+#define ADAPT_SMALL   16         // free blocks this small count as slivers
+
+static struct mem_adaptive_stats adapt;
+static strategies adaptWanted;   // path the last samples asked for
+static int adaptVotes;           // samples in a row that asked for it
+static size_t adaptCalls;        // allocations since the last sample
+static size_t adaptFailed;       // failed allocations since the last sample
+
+
+size_t mySize;                   // total bytes over all chunks
+void *myMemory = NULL;           // chunk 0
+
+static backings myBacking = Heap;
+static int myFlags;             // flags the pool was requested with
+static size_t myGrowth;         // minimum size of a chunk added on demand, 0 = fixed pool
+static size_t myRelease;        // free blocks this large give their pages back in myfree, 0 = never
+static size_t pageSize;
+
+static struct memChunk chunks[MAX_CHUNKS];
+static int chunkCount;
+
+static size_t myDirect;         // direct-map requests this large, 0 = never
+
+/* Freed blocks of up to myQuick bytes go on a quick list for their exact
+ * size instead of being merged, so that the next request of that size can
+ * have one back without a search or a split.  They are merged in bulk when
+ * their list is full, or when a request finds nothing that fits.  Like the
+ * worker's queue, the lists only hold hints: an entry counts only while its
+ * node is still a free block of that size. */
+#define QUICK_MAX   256         // largest size myQuick may be
+#define QUICK_DEPTH 32          // blocks held per size before they are merged
+
+static size_t myQuick;          // quick lists for freed blocks this small, 0 = none
+static size_t mySplit = 1;      // smallest remainder split off a block as a hole of its own
+static node_t quickList[QUICK_MAX + 1][QUICK_DEPTH];
+static int quickCount[QUICK_MAX + 1];
+static size_t quickHeld;        // entries over all quick lists
+static struct directMap *directMaps;
+static int directCount, directCap;
+static size_t directBytes;      // bytes requested by live direct maps
+
+static struct memHeader localHeader;
+static struct memHeader *hdr = &localHeader;
+static struct memoryList *slab;           // current node slab
+static struct memoryList *privateSlab;    // slab of private pools, kept across initmem
+
+static void *myMapping;         // whole mapping of a file-backed pool, NULL if none
 static struct memoryList *curr;
 
+static pthread_mutex_t *poolLock;    // taken around every operation when set
+
+/* Handles name blocks that mem_compact is allowed to move.  The table is
+ * indexed by handle, slot 0 unused, and free slots are chained through
+ * node.  Handles are private to the process, so only private pools have
+ * them.
+ */
+struct memHandle
+{
+  node_t node;         // the block; next free slot while unused
+  uint32_t pins;       // mem_handle_lock calls not yet undone; pinned blocks stay put
+};
+
+static struct memHandle *handles;
+static node_t handleUsed = 1, handleCap, handleFree;
+
+/* The heap profiler, see mem_profile_start.  Sampled blocks are tagged
+ * with a slot in the sample table, indexed like the handle table, and each
+ * sample points at its call stack in the stack table; equal stacks share an
+ * entry, found through a hash of their frames.  Like handles, samples are
+ * private to the process.
+ */
+#define PROFILE_DEPTH 32        // frames kept per stack
+#define PROFILE_HASH  1024      // chains in the stack hash
+
+struct memStack
+{
+  uint32_t next;       // next entry in its hash chain, plus one; 0 = none
+  int depth;
+  void *frames[PROFILE_DEPTH];
+  size_t live, live_bytes;     // sampled blocks still allocated
+  size_t count, bytes;         // every block ever sampled
+};
+
+struct memSample
+{
+  uint32_t stack;      // entry in the stack table; next free slot while unused
+  size_t size;
+};
+
+static int64_t profileCountdown = INT64_MAX;   // bytes until the next sample
+static size_t profileRate;      // mean bytes between samples, 0 = off
+static uint64_t profileSeed = 0x2545f4914f6cdd1dULL;
+static struct memStack *stacks;
+static uint32_t stackCount, stackCap;
+static uint32_t stackHash[PROFILE_HASH];      // first entry of each chain, plus one
+static struct memSample *samples;
+static node_t sampleUsed = 1, sampleCap, sampleFree;
+
+/* With the background worker running, myfree only marks a block free and
+ * queues its node; the worker merges it with its neighbours later, and
+ * compacts handle blocks when there is nothing to merge.  A queued node
+ * may have been merged away or even reused by the time the worker gets to
+ * it, so the queue is only a list of places worth looking at. */
+static pthread_t worker;
+static int workerRunning;
+static int workerWake, workerStop;   // under workerMutex
+static size_t workerBudget;          // bytes per mem_compact call, 0 = no compaction
+static pthread_mutex_t workerMutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t workerCond = PTHREAD_COND_INITIALIZER;
+static pthread_mutex_t localLock = PTHREAD_MUTEX_INITIALIZER;   // poolLock of a private pool while the worker runs
+static node_t *pending;
+static size_t pendingCount, pendingCap;
+
+#define WORKER_BATCH 64      // queued nodes merged per hold of the pool lock
+
+/* Statistics published with mem_export_start.  Updated under the pool lock
+ * at the end of every call that changes the pool, as a seqlock. */
+static struct mem_shared_stats *exported;  // NULL while not publishing
+static int exportLatency = -1;  // latency bucket of the call being published, -1 = none
+
+static void export_update(int op, int failed);
+
+#define EXPORT(op, failed) \
+	do { if (exported != NULL) export_update(op, failed); } while (0)
+
+/* Memory pressure callbacks, see mem_watch.  Checked after every mymalloc,
+ * myfree and myrealloc once the pool lock is released, so a callback may
+ * call back into the allocator; one check at a time, and none from inside
+ * a callback. */
+#define MAX_WATCHERS 16
+
+struct memWatcher
+{
+  mem_pressure_fn fn;  // NULL while the slot is unused
+  void *ctx;
+  struct mem_watermarks marks;
+  int high[3];         // per MEM_PRESSURE_* kind: pressure reported and not yet over
+  uint64_t last;       // when fn was last called, ns
+};
+
+static struct memWatcher watchers[MAX_WATCHERS];
+static int watchCount;          // slots in use
+static int watchBusy;           // a check is under way
+
+static void watch_check();
+
+#define WATCH() \
+	do { if (watchCount > 0) watch_check(); } while (0)
+
+/* Instrumentation, compiled in with -DMEM_INSTRUMENT (make DEFINES=-DMEM_INSTRUMENT).
+ * Counts go to the mem_stats of the current strategy, under the pool lock.
+ * Without it every INST_ macro is empty, so the allocator pays nothing.
+ */
+#ifdef MEM_INSTRUMENT
+static struct mem_stats instStats[Adaptive + 1];
+static size_t instVisits;       // nodes visited by the operation in progress
+
+/* A cycle counter where there is one, nanoseconds otherwise. */
+static uint64_t inst_clock()
+{
+#if defined(__x86_64__) || defined(__i386__)
+	return __rdtsc();
+#else
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+#endif
+}
+
+static void inst_record(struct mem_op_stats *op, uint64_t start)
+{
+	uint64_t t = inst_clock() - start;
+
+	op->calls++;
+	op->cycles += t;
+	op->visited += instVisits;
+	exportLatency = mem_latency_bucket(t);
+	op->latency[exportLatency]++;
+	instVisits = 0;
+}
+
+#define INST_START(t)        uint64_t t = inst_clock()
+#define INST_OP(op, t)       inst_record(&instStats[myStrategy].op, t)
+#define INST_VISIT()         (instVisits++)
+#define INST_COUNT(field)    (instStats[myStrategy].field++)
+#else
+#define INST_START(t)
+#define INST_OP(op, t)       ((void) 0)
+#define INST_VISIT()         ((void) 0)
+#define INST_COUNT(field)    ((void) 0)
+#endif
+
+/* Tracing, see mem_trace_start.  Records go to a ring that the flusher
+ * thread empties into the trace file.  The allocator is the only producer,
+ * as its calls are serialized by the pool lock (or made from one thread),
+ * and the flusher the only consumer, so the ring needs no lock: each side
+ * owns one index and publishes it with a release store.  A record that
+ * finds the ring full is dropped and counted rather than waited for.
+ */
+#define TRACE_RING  65536        // records, a power of two
+#define TRACE_BATCH 8192         // records the flusher collects before it writes
+
+static struct mem_trace_record *traceRing;  // NULL while not tracing
+static size_t traceHead, traceTail;         // next record to fill / to write
+static size_t traceLost;        // records dropped or not written; both sides add to it atomically
+static uint64_t traceLast;      // time of the previous record, ns
+static int traceFd = -1;
+static pthread_t traceThread;
+static int traceStop;           // under traceMutex
+static pthread_mutex_t traceMutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t traceCond = PTHREAD_COND_INITIALIZER;
+
+static uint64_t trace_clock()
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void trace_event(int op, size_t size, void *id, void *old, lifetimes lifetime)
+{
+	struct mem_trace_record *r;
+	uint64_t now;
+	size_t head = traceHead;
+
+	if (head - __atomic_load_n(&traceTail, __ATOMIC_ACQUIRE) == TRACE_RING) {
+	    __atomic_add_fetch(&traceLost, 1, __ATOMIC_RELAXED);
+	    return;
+	}
+	now = trace_clock();
+
+	r = &traceRing[head & (TRACE_RING - 1)];
+	r->op = op;
+	r->strategy = myStrategy;
+	r->lifetime = lifetime;
+	r->reserved = 0;
+	r->delta = now - traceLast > UINT32_MAX ? UINT32_MAX : now - traceLast;
+	r->size = size;
+	r->id = (uintptr_t) id;
+	r->old_id = (uintptr_t) old;
+	traceLast = now;
+	__atomic_store_n(&traceHead, head + 1, __ATOMIC_RELEASE);
+}
+
+#define TRACE(op, size, id, old, lifetime) \
+	do { if (traceRing != NULL) trace_event(op, size, id, old, lifetime); } while (0)
+
+static void absorb_next(struct memoryList *node);
+static int recover_list();
+static void drain_pending(size_t max);
+static void quick_flush_all();
+static struct memoryList *quick_take(size_t size);
+static void profile_sample(void *p, size_t size);
+static void profile_drop(node_t s);
+static void profile_resize(node_t s, size_t size);
+static void profile_forget(int untag);
+
+
+/* Reserve sz bytes of anonymous memory for the pool.  The kernel commits the
+ * pages one at a time on first touch, so a multi-gigabyte pool costs nothing
+ * up front and its RSS follows what is actually used.  MAP_NORESERVE keeps a
+ * pool larger than RAM+swap from being refused by overcommit accounting.
+ * On success *len is the length to hand back to munmap() and *applied holds
+ * the huge page flags that were honoured.
+ */
+static void *map_pool(size_t sz, int flags, size_t *len, int *applied)
+{
+	int mflags = MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE;
+	void *p;
+
+	*applied = 0;
+
+#ifdef MAP_HUGETLB
+	if (flags & MEM_HUGE_EXPLICIT) {
+	    /* No MAP_NORESERVE here: without a reservation a hugetlb mapping
+	     * succeeds even when the pool of huge pages is empty and then
+	     * SIGBUSes on first touch instead of letting us fall back. */
+	    *len = ROUND_UP(sz, HUGE_PAGE_SIZE);
+	    p = mmap(NULL, *len, PROT_READ | PROT_WRITE,
+	             (mflags & ~MAP_NORESERVE) | MAP_HUGETLB, -1, 0);
+	    if (p != MAP_FAILED) {
+	        *applied = MEM_HUGE_EXPLICIT;
+	        return p;
+	    }
+	    flags |= MEM_HUGE_TRANSPARENT; // no hugetlbfs pages reserved, try THP instead
+	}
+#endif
+
+	if (flags & MEM_HUGE_TRANSPARENT) {
+	    /* Over-reserve by one huge page so the pool can start on a 2 MiB
+	     * boundary; THP can only back naturally aligned ranges. */
+	    size_t want = ROUND_UP(sz, HUGE_PAGE_SIZE);
+	    char *raw = mmap(NULL, want + HUGE_PAGE_SIZE, PROT_READ | PROT_WRITE, mflags, -1, 0);
+	    char *aligned;
+
+	    if (raw == MAP_FAILED)
+	        return NULL;
+	    aligned = (char *) ROUND_UP((uintptr_t) raw, HUGE_PAGE_SIZE);
+	    if (aligned > raw)
+	        munmap(raw, aligned - raw);
+	    munmap(aligned + want, raw + HUGE_PAGE_SIZE - aligned);
+	    *len = want;
+#ifdef MADV_HUGEPAGE
+	    if (madvise(aligned, want, MADV_HUGEPAGE) == 0)
+	        *applied = MEM_HUGE_TRANSPARENT;
+#endif
+	    return aligned;
+	}
+
+	*len = ROUND_UP(sz, (size_t) sysconf(_SC_PAGESIZE));
+	p = mmap(NULL, *len, PROT_READ | PROT_WRITE, mflags, -1, 0);
+	return p == MAP_FAILED ? NULL : p;
+}
+
+/* Get sz bytes for a new chunk from the configured backing and record it in
+ * chunks[].  Returns the chunk index, or -1 if the memory is not available.
+ */
+static int add_chunk(size_t sz)
+{
+	struct memChunk *c;
+	int applied = 0;
+
+	if (chunkCount == MAX_CHUNKS)
+	    return -1;
+
+	c = &chunks[chunkCount];
+	c->mapped = 0;
+	if (myBacking == Mapped)
+	    c->base = map_pool(sz, myFlags, &c->mapped, &applied);
+	else
+	    c->base = malloc(sz);
+	if (c->base == NULL)
+	    return -1;
+
+	if (myFlags & MEM_PREFAULT) {
+	    size_t page = (size_t) sysconf(_SC_PAGESIZE);
+	    size_t i;
+	    for (i = 0; i < sz; i += page)
+	        ((volatile char *) c->base)[i] = 0;
+	    applied |= MEM_PREFAULT;
+	}
+	c->flags = applied;
+	c->size = sz;
+	mySize += sz;
+	return chunkCount++;
+}
+
+/* Hand chunks back to wherever they came from until only keep are left. */
+static void release_chunks(int keep)
+{
+	while (chunkCount > keep) {
+	    struct memChunk *c = &chunks[--chunkCount];
+	    mySize -= c->size;
+	    if (c->flags & CHUNK_EXTERNAL)
+	        continue;
+	    if (c->mapped)
+	        munmap(c->base, c->mapped);
+	    else
+	        free(c->base);
+	}
+}
+
+/* Hand every chunk back. */
+static void release_pool()
+{
+	release_chunks(0);
+	myMemory = NULL;
+	mySize = 0;
+}
+
+/* Unmap every direct-mapped block. */
+static void release_direct()
+{
+	while (directCount > 0) {
+	    struct directMap *d = &directMaps[--directCount];
+	    munmap(d->ptr, d->mapped);
+	}
+	directBytes = 0;
+}
+
+/* Get a node from the slab.  Returns NIL if the slab is full and cannot
+ * grow; any struct memoryList pointer held across this call may move. */
+static node_t new_node()
+{
+	node_t n = hdr->free_nodes;
+
+	if (n != NIL) {
+	    hdr->free_nodes = slab[n].next;
+	    return n;
+	}
+	if (hdr->slab_used >= hdr->slab_cap) {
+	    node_t cap = hdr->slab_cap ? hdr->slab_cap * 2 : 64;
+	    struct memoryList *grown;
+
+	    if (myMapping != NULL || cap <= hdr->slab_cap)
+	        return NIL;     // a file-backed slab has a fixed size
+	    grown = realloc(privateSlab, (size_t) cap * sizeof(struct memoryList));
+	    if (grown == NULL)
+	        return NIL;
+	    slab = privateSlab = grown;
+	    hdr->slab_cap = cap;
+	}
+	return hdr->slab_used++;
+}
+
+/* Every block is also in a treap ordered by (chunk, offset), so the block
+ * holding an address is found in O(log n) without walking the list.  The
+ * priority is a hash of the node index, which keeps the nodes free of an
+ * extra field and the shape of the tree independent of the order blocks
+ * were made in.  Splits, merges, compaction and region bumps move offsets
+ * but never past a neighbour, so only making and dropping blocks has to
+ * touch the tree.
+ */
+static uint32_t tree_prio(node_t n)
+{
+	uint32_t x = n;
+
+	x ^= x >> 16;
+	x *= 0x7feb352d;
+	x ^= x >> 15;
+	x *= 0x846ca68b;
+	x ^= x >> 16;
+	return x;
+}
+
+/* Does block a come before block b? */
+static int tree_before(node_t a, node_t b)
+{
+	if (slab[a].chunk != slab[b].chunk)
+	    return slab[a].chunk < slab[b].chunk;
+	return slab[a].offset < slab[b].offset;
+}
+
+static node_t tree_insert_at(node_t t, node_t n)
+{
+	node_t c;
+
+	if (t == NIL)
+	    return n;
+	if (tree_before(n, t)) {
+	    c = slab[t].left = tree_insert_at(slab[t].left, n);
+	    if (tree_prio(c) > tree_prio(t)) {
+	        slab[t].left = slab[c].right;
+	        slab[c].right = t;
+	        return c;
+	    }
+	} else {
+	    c = slab[t].right = tree_insert_at(slab[t].right, n);
+	    if (tree_prio(c) > tree_prio(t)) {
+	        slab[t].right = slab[c].left;
+	        slab[c].left = t;
+	        return c;
+	    }
+	}
+	return t;
+}
+
+/* Add block n, whose chunk and offset are set, to the index. */
+static void tree_insert(node_t n)
+{
+	slab[n].left = slab[n].right = NIL;
+	hdr->tree = tree_insert_at(hdr->tree, n);
+}
+
+/* Join two trees where everything in a comes before everything in b. */
+static node_t tree_join(node_t a, node_t b)
+{
+	if (a == NIL)
+	    return b;
+	if (b == NIL)
+	    return a;
+	if (tree_prio(a) > tree_prio(b)) {
+	    slab[a].right = tree_join(slab[a].right, b);
+	    return a;
+	}
+	slab[b].left = tree_join(a, slab[b].left);
+	return b;
+}
+
+static node_t tree_remove_at(node_t t, node_t n)
+{
+	if (t == NIL)
+	    return NIL;
+	if (t == n)
+	    return tree_join(slab[t].left, slab[t].right);
+	if (tree_before(n, t))
+	    slab[t].left = tree_remove_at(slab[t].left, n);
+	else
+	    slab[t].right = tree_remove_at(slab[t].right, n);
+	return t;
+}
+
+/* Free blocks are indexed a second time, in a treap ordered by (size,
+ * address) that keeps the size of every subtree, so the statistics about
+ * holes come out of it in O(log n) instead of a walk of the block list; a
+ * histogram by powers of two and the free byte count are kept alongside.
+ * A block is in it exactly while it is free and linked, and it is dropped
+ * and added again around every change to its size or offset.  Dropping a
+ * block that is not in it does nothing, which lets mem_recover start it
+ * over from empty.
+ */
+static node_t free_count(node_t t)
+{
+	return t == NIL ? 0 : slab[t].count;
+}
+
+static void free_fix(node_t t)
+{
+	slab[t].count = 1 + free_count(slab[t].sleft) + free_count(slab[t].sright);
+}
+
+/* Does free block a sort before free block b? */
+static int free_before(node_t a, node_t b)
+{
+	if (slab[a].size != slab[b].size)
+	    return slab[a].size < slab[b].size;
+	return tree_before(a, b);
+}
+
+static int hist_bucket(size_t size)
+{
+	int b = 0;
+
+	while (size >>= 1)
+	    b++;
+	return b;
+}
+
+static node_t free_insert_at(node_t t, node_t n)
+{
+	node_t c;
+
+	if (t == NIL)
+	    return n;
+	if (free_before(n, t)) {
+	    c = slab[t].sleft = free_insert_at(slab[t].sleft, n);
+	    if (tree_prio(c) > tree_prio(t)) {
+	        slab[t].sleft = slab[c].sright;
+	        slab[c].sright = t;
+	        free_fix(t);
+	        free_fix(c);
+	        return c;
+	    }
+	} else {
+	    c = slab[t].sright = free_insert_at(slab[t].sright, n);
+	    if (tree_prio(c) > tree_prio(t)) {
+	        slab[t].sright = slab[c].sleft;
+	        slab[c].sleft = t;
+	        free_fix(t);
+	        free_fix(c);
+	        return c;
+	    }
+	}
+	free_fix(t);
+	return t;
+}
+
+static node_t free_join(node_t a, node_t b)
+{
+	if (a == NIL)
+	    return b;
+	if (b == NIL)
+	    return a;
+	if (tree_prio(a) > tree_prio(b)) {
+	    slab[a].sright = free_join(slab[a].sright, b);
+	    free_fix(a);
+	    return a;
+	}
+	slab[b].sleft = free_join(a, slab[b].sleft);
+	free_fix(b);
+	return b;
+}
+
+static node_t free_remove_at(node_t t, node_t n, int *found)
+{
+	if (t == NIL)
+	    return NIL;
+	if (t == n) {
+	    *found = 1;
+	    return free_join(slab[t].sleft, slab[t].sright);
+	}
+	if (free_before(n, t))
+	    slab[t].sleft = free_remove_at(slab[t].sleft, n, found);
+	else
+	    slab[t].sright = free_remove_at(slab[t].sright, n, found);
+	free_fix(t);
+	return t;
+}
+
+/* Add free block n to the index of free blocks. */
+static void free_add(node_t n)
+{
+	slab[n].sleft = slab[n].sright = NIL;
+	slab[n].count = 1;
+	hdr->free_tree = free_insert_at(hdr->free_tree, n);
+	hdr->free_bytes += slab[n].size;
+	hdr->histogram[hist_bucket(slab[n].size)]++;
+}
+
+/* Drop block n from the index of free blocks, if it is there. */
+static void free_drop(node_t n)
+{
+	int found = 0;
+
+	hdr->free_tree = free_remove_at(hdr->free_tree, n, &found);
+	if (found) {
+	    hdr->free_bytes -= slab[n].size;
+	    hdr->histogram[hist_bucket(slab[n].size)]--;
+	}
+}
+
+/* Start both indexes over from nothing. */
+static void reset_indexes()
+{
+	hdr->tree = NIL;
+	hdr->free_tree = NIL;
+	hdr->free_bytes = 0;
+	memset(hdr->histogram, 0, sizeof(hdr->histogram));
+}
+
+/* Put a node that is no longer linked into the block list back on the free
+ * list, dropping it from the indexes. */
+static void free_node(node_t n)
+{
+	hdr->tree = tree_remove_at(hdr->tree, n);
+	if (!slab[n].alloc)
+	    free_drop(n);
+	slab[n].chunk = -1;         // tells the worker the node is no longer a block
+	slab[n].next = hdr->free_nodes;
+	hdr->free_nodes = n;
+}
+
+/* Make a block of size bytes at offset in chunk c and link it in after tail
+ * (or as head if tail is NIL).  Returns NIL if no node was available. */
+static node_t add_block(int c, size_t offset, size_t size, char alloc, node_t tail)
+{
+	node_t n = new_node();
+	struct memoryList *node = NODE(n);
+
+	if (node == NULL)
+	    return NIL;
+	node->next = NIL;
+	node->last = tail;
+	node->size = size;
+	node->offset = offset;
+	node->alloc = alloc;
+	node->held = 0;
+	node->released = 0;
+	node->chunk = c;
+	node->handle = 0;
+	node->sample = 0;
+	node->slack = 0;
+	tree_insert(n);
+	if (!alloc)
+	    free_add(n);
+	if (tail != NIL)
+	    slab[tail].next = n;
+	else
+	    hdr->head = n;
+	return n;
+}
+
+/* Make a single free block covering chunk c, see add_block. */
+static node_t chunk_block(int c, node_t tail)
+{
+	return add_block(c, 0, chunks[c].size, 0, tail);
+}
+
+/* Start over with an empty private slab and header. */
+static void reset_private_header()
+{
+	node_t cap = localHeader.slab_cap;
+
+	memset(&localHeader, 0, sizeof(localHeader));
+	localHeader.slab_cap = cap;
+	localHeader.slab_used = 1;
+	hdr = &localHeader;
+	slab = privateSlab;
+	handleUsed = 1;
+	handleFree = 0;
+	memset(quickCount, 0, sizeof(quickCount));
+	quickHeld = 0;
+}
+
+/* Detach from a file-backed pool, marking it as cleanly shut down. */
+static void close_mapping()
+{
+	size_t len;
+
+	if (myMapping == NULL)
+	    return;
+	len = hdr->length;
+	if (myBacking == FileBacked) {
+	    hdr->dirty = 0;
+	    msync(myMapping, len, MS_SYNC);
+	}
+	munmap(myMapping, len);
+	myMapping = NULL;
+	poolLock = NULL;
+	chunkCount = 0;
+	mySize = 0;
+	myMemory = NULL;
+	reset_private_header();
+}
+
 
 /* initmem must be called prior to mymalloc and myfree.
 
@@ -44,328 +862,2397 @@ static struct memoryList *curr;
 		- "worst" (worst-fit)
 		- "first" (first-fit)
 		- "next" (next-fit)
+		- "region" (bump allocation, see mem_mark)
    sz specifies the number of bytes that will be available, in total, for all mymalloc requests.
 */
 
-void initmem(strategies strategy, size_t sz)
+void initmem(strategies strategy, size_t sz)
+{
+	initmem_opts(strategy, sz, NULL);
+}
+
+/* Like initmem, but lets the caller choose how the pool is backed.
+   With opts->backing == Mapped the pool is reserved with mmap and committed
+   lazily; MEM_HUGE_TRANSPARENT / MEM_HUGE_EXPLICIT ask for huge pages (explicit
+   falls back to transparent, transparent falls back to normal pages) and
+   MEM_PREFAULT touches every page up front.  With opts->grow > 0 the pool is
+   not fixed: when no block fits, a further chunk of at least opts->grow
+   bytes is added from the same backing.  opts may be NULL.
+*/
+void initmem_opts(strategies strategy, size_t sz, const struct mem_options *opts)
+{
+	static const struct mem_options defaults;
+
+	if (opts == NULL)
+	    opts = &defaults;
+
+	mem_worker_stop();
+	myStrategy = strategy;
+	TRACE(MEM_TRACE_INIT, sz, NULL, NULL, AnyLifetime);
+	memset(&adapt, 0, sizeof(adapt));
+	adapt.active = Next;
+	adaptWanted = Next;
+	adaptVotes = adaptCalls = adaptFailed = 0;
+
+	close_mapping();
+	release_direct();
+	profile_forget(0);
+
+	/* Every node goes at once: the slab is rewound, not walked. */
+	reset_private_header();
+
+	/* Same size and backing as before: keep the memory we already have. */
+	if (chunkCount > 0 && chunks[0].base != NULL && chunks[0].size == sz
+	    && myBacking == opts->backing && myFlags == opts->flags) {
+	    release_chunks(1);
+	    myGrowth = opts->grow;
+	    myRelease = opts->release;
+	    myDirect = opts->direct;
+	    myQuick = opts->quick < QUICK_MAX ? opts->quick : QUICK_MAX;
+	    mySplit = opts->min_split ? opts->min_split : 1;
+	    hdr->head = chunk_block(0, NIL);
+	    hdr->rover = hdr->head;
+	    EXPORT(0, 0);
+	    return;
+	}
+	release_pool(); /* in case this is not the first time initmem2 is called */
+
+	myBacking = opts->backing;
+	myFlags = opts->flags;
+	myGrowth = opts->grow;
+	myRelease = opts->release;
+	myDirect = opts->direct;
+	myQuick = opts->quick < QUICK_MAX ? opts->quick : QUICK_MAX;
+	mySplit = opts->min_split ? opts->min_split : 1;
+	pageSize = (size_t) sysconf(_SC_PAGESIZE);
+
+	/* all implementations will need an actual block of memory to use */
+	if (add_chunk(sz) < 0) {
+	    /* every mymalloc will fail rather than hand out bytes we do not have */
+	    chunks[0].base = NULL;
+	    chunks[0].size = 0;
+	    chunks[0].mapped = 0;
+	    chunks[0].flags = 0;
+	    chunkCount = 1;
+	}
+	myMemory = chunks[0].base;
+
+	hdr->head = chunk_block(0, NIL);
+	hdr->rover = hdr->head;
+	EXPORT(0, 0);
+}
+
+/* Lay out a new pool file of sz bytes: header, node slab, then the pool on
+ * a page boundary.  The file is sparse, so the slab only costs disk space
+ * for the nodes actually used; it gets room for one node per 16 bytes. */
+static size_t file_layout(size_t sz, struct memHeader *h)
+{
+	size_t cap = sz / 16 + 64;
+
+	if (cap > UINT32_MAX - 1)
+	    cap = UINT32_MAX - 1;
+	memset(h, 0, sizeof(*h));
+	h->magic = MEM_MAGIC;
+	h->version = MEM_VERSION;
+	h->slab_offset = ROUND_UP(sizeof(struct memHeader), 64);
+	h->slab_cap = (node_t) cap;
+	h->pool_offset = ROUND_UP(h->slab_offset + cap * sizeof(struct memoryList), pageSize);
+	h->pool_size = sz;
+	h->length = h->pool_offset + sz;
+	return h->length;
+}
+
+/* Map the pool file behind fd, at the address it was last mapped at if the
+ * kernel agrees, and make it the current pool.  With fresh set, h is the
+ * layout of a new pool that is written into the mapping and given a single
+ * free block and an initialised lock.  Returns 0 on success. */
+static int attach_mapping(int fd, struct memHeader *h, int fresh, backings backing)
+{
+	void *map = mmap(h->base, h->length, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+
+	if (map == MAP_FAILED)
+	    return -1;
+
+	myMapping = map;
+	hdr = map;
+	slab = (struct memoryList *) ((char *) map + h->slab_offset);
+
+	chunks[0].base = (char *) map + h->pool_offset;
+	chunks[0].size = h->pool_size;
+	chunks[0].mapped = 0;
+	chunks[0].flags = CHUNK_EXTERNAL;
+	chunkCount = 1;
+	mySize = h->pool_size;
+	myMemory = chunks[0].base;
+	myBacking = backing;
+	myFlags = 0;
+
+	if (fresh) {
+	    pthread_mutexattr_t attr;
+	    uint64_t magic = h->magic;
+
+	    h->magic = 0;           // published last, once the pool is usable
+	    *hdr = *h;
+	    hdr->slab_used = 1;
+	    pthread_mutexattr_init(&attr);
+	    pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+	    pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+	    pthread_mutex_init(&hdr->lock, &attr);
+	    pthread_mutexattr_destroy(&attr);
+	    hdr->head = chunk_block(0, NIL);
+	    hdr->rover = hdr->head;
+	    __atomic_store_n(&hdr->magic, magic, __ATOMIC_RELEASE);
+	}
+	if (backing == Shared)
+	    poolLock = &hdr->lock;
+	return 0;
+}
+
+/* Like initmem, but the pool and all of its block metadata live in the file
+   at path, mapped MAP_SHARED.  The metadata only holds offsets and slab
+   indices, so a later process can map the file again and find every block
+   where it left it; mem_root()/mem_set_root() give it a place to start.
+   If path already holds a pool it is attached as is and sz is ignored.  If
+   that pool was not detached cleanly (mem_close, or initmem of another pool)
+   mem_recover checks and repairs it first.  Only one process may have the
+   file attached at a time; see initmem_shared for sharing a pool.
+   Returns 0 if a new pool was created, 1 if an existing one was attached,
+   2 if it was attached after recovery, -1 on error or an unrecoverable file;
+   on error the allocator is left with an empty pool.
+   A file-backed pool never grows and does not direct-map or release pages.
+*/
+int initmem_file(strategies strategy, size_t sz, const char *path)
+{
+	struct memHeader h;
+	struct stat st;
+	int fd, result = 0;
+
+	initmem(strategy, 0);
+	release_pool();
+
+	fd = open(path, O_RDWR | O_CREAT, 0600);
+	if (fd < 0 || fstat(fd, &st) != 0)
+	    goto fail;
+
+	if (pread(fd, &h, sizeof(h), 0) == sizeof(h) && h.magic == MEM_MAGIC
+	    && h.version == MEM_VERSION && h.length == (size_t) st.st_size) {
+	    result = 1;
+	} else {
+	    /* Start from an empty file so no stale bytes survive in the sparse parts. */
+	    file_layout(sz, &h);
+	    if (ftruncate(fd, 0) != 0 || ftruncate(fd, h.length) != 0)
+	        goto fail;
+	}
+
+	if (attach_mapping(fd, &h, result == 0, FileBacked) != 0)
+	    goto fail;
+	close(fd);
+
+	if (result == 1 && hdr->dirty) {
+	    if (recover_list() < 0) {
+	        munmap(myMapping, h.length);    // leave the evidence on disk untouched
+	        myMapping = NULL;
+	        hdr = &localHeader;
+	        initmem(strategy, 0);
+	        return -1;
+	    }
+	    result = 2;
+	}
+	hdr->base = myMapping;
+	hdr->dirty = 1;
+	TRACE(MEM_TRACE_INIT, mySize, NULL, NULL, AnyLifetime);
+	EXPORT(0, 0);
+	return result;
+
+fail:
+	if (fd >= 0)
+	    close(fd);
+	initmem(strategy, 0);
+	return -1;
+}
+
+/* Like initmem_file, but the pool lives in the POSIX shared memory object
+   name (see shm_open) and any number of processes can attach to it at once.
+   The first caller creates a pool of sz bytes; later callers attach to it
+   and sz is ignored.  mymalloc, myfree and the mem_* statistics take a
+   process-shared robust mutex in the header, so blocks can be allocated in
+   one process and freed in another.  If a process dies while holding it,
+   the next one to lock the pool runs mem_recover before going on.
+   Blocks are found across processes with mem_offset()/mem_at(), or directly
+   by pointer in processes forked after the pool was attached.
+   Returns 0 if the pool was created, 1 if it was attached, -1 on error.
+   The object outlives its processes until shm_unlink(name).
+*/
+int initmem_shared(strategies strategy, size_t sz, const char *name)
+{
+	struct memHeader h;
+	struct stat st;
+	int fd, tries, result = 0;
+
+	initmem(strategy, 0);
+	release_pool();
+
+	fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600);
+	if (fd >= 0) {
+	    file_layout(sz, &h);
+	    if (ftruncate(fd, h.length) != 0)
+	        goto fail;
+	} else {
+	    if (errno != EEXIST || (fd = shm_open(name, O_RDWR, 0600)) < 0)
+	        goto fail;
+	    /* The creator may still be setting the pool up; wait for its magic. */
+	    for (tries = 0; ; tries++) {
+	        if (fstat(fd, &st) == 0 && (size_t) st.st_size >= sizeof(h)
+	            && pread(fd, &h, sizeof(h), 0) == sizeof(h)
+	            && __atomic_load_n(&h.magic, __ATOMIC_ACQUIRE) == MEM_MAGIC
+	            && h.version == MEM_VERSION && h.length == (size_t) st.st_size)
+	            break;
+	        if (tries == 1000)
+	            goto fail;
+	        usleep(1000);
+	    }
+	    h.base = NULL;      // every process maps it wherever it likes
+	    result = 1;
+	}
+
+	if (attach_mapping(fd, &h, result == 0, Shared) != 0)
+	    goto fail;
+	close(fd);
+	TRACE(MEM_TRACE_INIT, mySize, NULL, NULL, AnyLifetime);
+	EXPORT(0, 0);
+	return result;
+
+fail:
+	if (fd >= 0)
+	    close(fd);
+	initmem(strategy, 0);
+	return -1;
+}
+
+/* Detach from a file-backed or shared pool, leaving a file-backed one marked
+   as cleanly shut down, and fall back to an empty private pool.  Does
+   nothing for other pools. */
+void mem_close()
+{
+	if (myMapping != NULL)
+	    initmem(myStrategy, 0);
+}
+
+/* Lock the pool if it is shared.  A robust mutex tells the next locker when
+ * its previous owner died in the middle of an update; the list is repaired
+ * before anyone uses it, and marked broken if that is not possible. */
+static void lock_pool()
+{
+	if (poolLock == NULL)
+	    return;
+	if (pthread_mutex_lock(poolLock) == EOWNERDEAD) {
+	    if (recover_list() < 0)
+	        hdr->broken = 1;
+	    pthread_mutex_consistent(poolLock);
+	}
+}
+
+static void unlock_pool()
+{
+	if (poolLock != NULL)
+	    pthread_mutex_unlock(poolLock);
+}
+
+/* Drop every block at once and start over with one free block per chunk,
+   keeping the backing memory (grown chunks included) and every option.
+   The node slab is rewound rather than walked, so the cost does not depend
+   on how many blocks were live; only direct-mapped blocks are unmapped one
+   by one.  Meant for using the pool as a per-request arena.  Any pointer
+   into the pool is invalid afterwards, and so is the root.
+*/
+void mem_reset()
+{
+	node_t tail = NIL;
+	int c;
+
+	lock_pool();
+	release_direct();
+	profile_forget(0);
+	hdr->slab_used = 1;
+	hdr->free_nodes = NIL;
+	hdr->head = NIL;
+	reset_indexes();
+	hdr->root = 0;
+	hdr->broken = 0;
+	handleUsed = 1;
+	handleFree = 0;
+	pendingCount = 0;
+	memset(quickCount, 0, sizeof(quickCount));
+	quickHeld = 0;
+	for (c = 0; c < chunkCount; c++)
+	    tail = chunk_block(c, tail);
+	hdr->rover = hdr->head;
+	EXPORT(0, 0);
+	unlock_pool();
+}
+
+/* Region strategy: the current end of the region, to hand to mem_release
+   later.  The value only means something to mem_release: the chunk in the
+   top bits and the offset in that chunk below MARK_SHIFT. */
+#define MARK_SHIFT 48
+#define MARK_OFFSET (((size_t) 1 << MARK_SHIFT) - 1)
+
+size_t mem_mark()
+{
+	struct memoryList *f;
+	size_t mark;
+
+	lock_pool();
+	for (f = NODE(hdr->rover); f != NULL && f->alloc; f = NEXT(f))
+	    ;
+	if (f != NULL)
+	    mark = (size_t) f->chunk << MARK_SHIFT | f->offset;
+	else
+	    mark = (size_t) chunkCount << MARK_SHIFT;
+	unlock_pool();
+	return mark;
+}
+
+/* Free everything allocated since mem_mark returned mark, in one go.  Marks
+   taken after mark are invalid afterwards.  Only the blocks of the chunk
+   holding the mark and of the chunks after it are touched, so with a pool
+   that did not grow this is O(1).  Does nothing for other strategies.
+*/
+void mem_release(size_t mark)
+{
+	int c = (int) (mark >> MARK_SHIFT);
+	size_t used = mark & MARK_OFFSET;
+	node_t n, next, tail = NIL;
+	int i;
+
+	lock_pool();
+	if (myStrategy != Region || hdr->broken) {
+	    unlock_pool();
+	    return;
+	}
+
+	/* unlink the blocks of chunk c onwards, then lay those chunks out again */
+	for (n = hdr->head; n != NIL && slab[n].chunk < c; n = slab[n].next)
+	    tail = n;
+	if (tail != NIL)
+	    slab[tail].next = NIL;
+	else
+	    hdr->head = NIL;
+	for (; n != NIL; n = next) {
+	    next = slab[n].next;
+	    free_node(n);
+	}
+
+	hdr->rover = NIL;
+	for (i = c; i < chunkCount; i++, used = 0) {
+	    if (used > 0 && (tail = add_block(i, 0, used, 1, tail)) == NIL)
+	        break;
+	    if (used < chunks[i].size) {
+	        if ((tail = add_block(i, used, chunks[i].size - used, 0, tail)) == NIL)
+	            break;
+	        if (hdr->rover == NIL)
+	            hdr->rover = tail;
+	    }
+	}
+	if (i < chunkCount)
+	    hdr->broken = 1;    /* out of nodes: the list no longer covers the pool */
+	EXPORT(0, 0);
+	unlock_pool();
+}
+
+/* Check the block list of the pool, typically after an unclean shutdown,
+   and repair what a crash in the middle of mymalloc or myfree can leave:
+     - a block size that disagrees with where the next block starts
+       (a split or merge that was cut short),
+     - back links that disagree with the forward links,
+     - adjacent free blocks,
+     - nodes that are in neither the list nor the free list.
+   Only the forward links and the block offsets are trusted.
+   Returns 0 if everything was consistent, 1 if something was repaired and
+   -1 if the list is broken beyond that (bad links, blocks outside the pool).
+*/
+int mem_recover()
+{
+	int result;
+
+	lock_pool();
+	result = recover_list();
+	if (result >= 0)
+	    hdr->broken = 0;
+	unlock_pool();
+	return result;
+}
+
+/* Is block n in the address index / the index of free blocks? */
+static int tree_has(node_t n)
+{
+	node_t t = hdr->tree;
+
+	while (t != NIL && t != n)
+	    t = tree_before(n, t) ? slab[t].left : slab[t].right;
+	return t == n;
+}
+
+static int free_has(node_t n)
+{
+	node_t t = hdr->free_tree;
+
+	while (t != NIL && t != n)
+	    t = free_before(n, t) ? slab[t].sleft : slab[t].sright;
+	return t == n;
+}
+
+/* The checks of mem_verify on one block.  O(log n). */
+static int verify_block(node_t n)
+{
+	struct memoryList *b = &slab[n];
+	struct memoryList *prev = NODE(b->last), *next = NEXT(b);
+
+	if (n >= hdr->slab_used || b->chunk < 0 || b->chunk >= chunkCount
+	    || (b->alloc != 0 && b->alloc != 1))
+	    return MEM_VERIFY_LINKS;
+	if (prev == NULL ? hdr->head != n : b->last >= hdr->slab_used || prev->next != n)
+	    return MEM_VERIFY_LINKS;
+	if (next != NULL && (b->next >= hdr->slab_used || next->last != n))
+	    return MEM_VERIFY_LINKS;
+
+	if (prev == NULL || prev->chunk != b->chunk) {
+	    if (b->offset != 0 || (prev != NULL && prev->chunk > b->chunk))
+	        return MEM_VERIFY_LAYOUT;
+	} else if (prev->offset + prev->size != b->offset) {
+	    return MEM_VERIFY_LAYOUT;
+	}
+	if ((next == NULL || next->chunk != b->chunk)
+	    && b->offset + b->size != chunks[b->chunk].size)
+	    return MEM_VERIFY_LAYOUT;
+
+	/* held blocks wait on a quick list or the worker's queue to be merged */
+	if (!b->alloc && next != NULL && !next->alloc && next->chunk == b->chunk
+	    && !b->held && !next->held)
+	    return MEM_VERIFY_ADJACENT;
+
+	if (!tree_has(n) || free_has(n) == b->alloc)
+	    return MEM_VERIFY_INDEX;
+	return 0;
+}
+
+/* Check the pool for corruption without changing it: that the links agree
+   both ways, that the blocks of each chunk follow each other without gaps
+   and cover it, that no two free blocks are left next to each other, that
+   every block is in the indexes, and that the free byte count, the number
+   of holes and the histogram add up.  With window == 0 the whole pool is
+   checked, in O(n log n).  Otherwise only a run of up to window blocks from
+   a block picked at random is, in O(window log n), along with whatever of
+   the counters can be had without a walk; called often enough, that gets
+   round the whole pool at a cost that can be left on in production.
+   Returns 0 if nothing is wrong, or the MEM_VERIFY_* code of the first
+   problem found.
+*/
+int mem_verify(size_t window)
+{
+	static uint64_t seed = 0x9e3779b97f4a7c15ULL;
+	size_t histogram[MEM_HIST_BUCKETS];
+	size_t steps = 0, holes = 0, free = 0, i;
+	node_t n = NIL;
+	int result = 0, tries;
+
+	lock_pool();
+	if (hdr->broken || hdr->head == NIL || hdr->head >= hdr->slab_used) {
+	    unlock_pool();
+	    return MEM_VERIFY_LINKS;
+	}
+
+	if (window == 0) {
+	    n = hdr->head;
+	} else {
+	    /* a random slot that holds a block; the head if none turns up */
+	    for (tries = 0; tries < 8 && n == NIL; tries++) {
+	        seed ^= seed << 13;
+	        seed ^= seed >> 7;
+	        seed ^= seed << 17;
+	        n = 1 + seed % (hdr->slab_used - 1);
+	        if (slab[n].chunk < 0)
+	            n = NIL;
+	    }
+	    if (n == NIL)
+	        n = hdr->head;
+	}
+
+	memset(histogram, 0, sizeof(histogram));
+	for (; n != NIL && result == 0; n = slab[n].next) {
+	    if (++steps > hdr->slab_used) {
+	        result = MEM_VERIFY_LINKS;          // a cycle
+	        break;
+	    }
+	    result = verify_block(n);
+	    if (!slab[n].alloc) {
+	        holes++;
+	        free += slab[n].size;
+	        histogram[hist_bucket(slab[n].size)]++;
+	    }
+	    if (window > 0 && steps == window)
+	        break;
+	}
+
+	if (result == 0 && window == 0
+	    && (free != hdr->free_bytes || holes != free_count(hdr->free_tree)
+	        || memcmp(histogram, hdr->histogram, sizeof(histogram)) != 0))
+	    result = MEM_VERIFY_COUNTERS;
+	if (result == 0) {
+	    for (holes = 0, i = 0; i < MEM_HIST_BUCKETS; i++)
+	        holes += hdr->histogram[i];
+	    if (holes != free_count(hdr->free_tree) || hdr->free_bytes > mySize)
+	        result = MEM_VERIFY_COUNTERS;
+	}
+	unlock_pool();
+	return result;
+}
+
+static int recover_list()
+{
+	char *seen;
+	node_t n, prev = NIL;
+	int repaired = 0;
+
+	if (hdr->slab_used == 0 || hdr->slab_used > hdr->slab_cap
+	    || hdr->head == NIL || hdr->head >= hdr->slab_used)
+	    return -1;
+	seen = calloc(hdr->slab_used, 1);
+	if (seen == NULL)
+	    return -1;
+
+	for (n = hdr->head; n != NIL; prev = n, n = slab[n].next) {
+	    struct memoryList *b = &slab[n];
+
+	    if (n >= hdr->slab_used || seen[n] || b->chunk < 0 || b->chunk >= chunkCount
+	        || b->offset >= chunks[b->chunk].size)
+	        goto broken;
+	    seen[n] = 1;
+
+	    if (b->last != prev) {
+	        b->last = prev;
+	        repaired = 1;
+	    }
+	    if (b->alloc != 0 && b->alloc != 1) {
+	        b->alloc = 1;
+	        repaired = 1;
+	    }
+	    if (prev == NIL || slab[prev].chunk != b->chunk) {
+	        if (b->offset != 0)
+	            goto broken;
+	    } else if (slab[prev].offset + slab[prev].size != b->offset) {
+	        if (b->offset <= slab[prev].offset)
+	            goto broken;
+	        slab[prev].size = b->offset - slab[prev].offset;
+	        repaired = 1;
+	    }
+	    if (b->next == NIL || slab[b->next].chunk != b->chunk) {
+	        if (b->offset + b->size != chunks[b->chunk].size) {
+	            b->size = chunks[b->chunk].size - b->offset;
+	            repaired = 1;
+	        }
+	    }
+	}
+
+	/* Rebuild the free list from everything the walk did not reach, and
+	   the index from everything it did. */
+	reset_indexes();
+	hdr->free_nodes = NIL;
+	for (n = hdr->slab_used - 1; n > NIL; n--) {
+	    if (!seen[n])
+	        free_node(n);
+	}
+	free(seen);
+
+	for (curr = NODE(hdr->head); curr != NULL; curr = NEXT(curr)) {
+	    curr->held = 0;             // the lists that held blocks died with their process
+	    curr->released = 0;
+	    while (!curr->alloc && curr->next != NIL && !NEXT(curr)->alloc
+	           && NEXT(curr)->chunk == curr->chunk) {
+	        absorb_next(curr);
+	        repaired = 1;
+	    }
+	}
+
+	for (n = hdr->head; n != NIL; n = slab[n].next) {
+	    tree_insert(n);
+	    if (!slab[n].alloc)
+	        free_add(n);
+	}
+
+	hdr->rover = hdr->head;
+	if (hdr->root > chunks[0].size)
+	    hdr->root = 0;
+	return repaired;
+
+broken:
+	free(seen);
+	return -1;
+}
+
+/* Allocate a block of memory with the requested size.
+ *  If the requested block is not available, mymalloc returns NULL.
+ *  Otherwise, it returns a pointer to the newly allocated block.
+ *  Restriction: requested >= 1 
+ */
+
+// Søg funktion for Worst-Fit strategi.
+// gotten from Volkan Isik s180103
+struct memoryList* worstSearch(size_t size){
+    struct memoryList *search = NULL;
+    struct memoryList *biggestnode = NULL;
+    search = NODE(hdr->head);
+    size_t worstSize = 0;
+
+    while (search!=NULL){
+        INST_VISIT();
+        if(search->size>=size && search->alloc==0){
+            if(search->size > worstSize) {
+                biggestnode = search;
+                worstSize = search->size;
+            }
+        }
+        search=NEXT(search);
+    }
+    if(biggestnode != NULL)
+        return biggestnode;
+    else
+        return NULL;
+}
+
+// Søg funktion for First-Fit strategi.
+// gotten from Volkan Isik s180103
+struct memoryList* firstSearch(size_t size){
+    struct memoryList *search = NULL;
+    search = NODE(hdr->head);
+
+    while (search!=NULL){
+        INST_VISIT();
+        if(search->size >= size && search->alloc==0){
+            return search;
+        }
+        search=NEXT(search);
+    }
+    return NULL;
+}
+
+// Search function for Best-Fit: smallest free block that is large enough,
+// the one with the lowest address on ties.
+struct memoryList* bestSearch(size_t size){
+    struct memoryList *best = NULL;
+    curr = NODE(hdr->head); //Start at head
+    while (curr != NULL) {
+        INST_VISIT();
+        if (!curr->alloc && curr->size >= size) { //If not allocated and have room to store requested do:
+            if (best == NULL || curr->size < best->size) { //If the new block is smaller than the best so far do:
+                best = curr; //Save smallest available block possible
+                if (best->size == size)
+                    break; //Can't do better than an exact fit
+            }
+        }
+        curr = NEXT(curr);
+    }
+    return best;
+}
+
+/* Search function for Next-Fit: first suitable block at or after the rover,
+ * wrapping around from the end of the list to the head. */
+struct memoryList* nextSearch(size_t size){
+    struct memoryList *start = NODE(hdr->rover != NIL ? hdr->rover : hdr->head);
+
+    curr = start;
+    do {
+        INST_VISIT();
+        if (!curr->alloc && curr->size >= size) {
+            return curr;
+        }
+        curr = NODE(curr->next != NIL ? curr->next : hdr->head);
+    } while (curr != start);
+    return NULL;
+}
+
+// Search function for short-lived blocks: the large enough free block
+// nearest the end of the pool.
+struct memoryList* lastSearch(size_t size){
+    struct memoryList *found = NULL;
+
+    for (curr = NODE(hdr->head); curr != NULL; curr = NEXT(curr)) {
+        INST_VISIT();
+        if (!curr->alloc && curr->size >= size) {
+            found = curr;
+        }
+    }
+    return found;
+}
+
+/* Pick a free block of at least requested bytes.  A lifetime hint decides
+ * the end of the pool to take it from, otherwise the current strategy does. */
+static struct memoryList *find_fit(size_t requested, lifetimes lifetime)
+{
+	if (lifetime == LongLived)
+	    return firstSearch(requested);
+	if (lifetime == ShortLived)
+	    return lastSearch(requested);
+
+	switch (myStrategy == Adaptive ? adapt.active : myStrategy)
+	  {
+	  case First:
+	      return firstSearch(requested);
+	  case Best:
+	      return bestSearch(requested);
+	  case Worst:
+	      return worstSearch(requested);
+	  case Next:
+	      return nextSearch(requested);
+	  default:
+	      return NULL;
+	  }
+}
+
+/* Allocate the first requested bytes of the free block trav.  Any remainder
+ * becomes a new free block right after it.  Returns NULL if that needed a
+ * node and the slab had none left.
+ *
+ * The order of the writes matters for file-backed pools: the new node is
+ * complete before it is linked, and trav shrinks last, so a crash at any
+ * point leaves something mem_recover can put right. */
+static struct memoryList *take_block(struct memoryList *trav, size_t requested)
+{
+    node_t t = INDEX(trav);
+
+    if (trav->size >= requested + mySplit) {
+        /* Her bliver den nye node alloceret i vores hukommelse.  */
+        node_t n = new_node();
+        struct memoryList *newNode;
+
+        if (n == NIL)
+            return NULL;
+        trav = &slab[t];        // the slab may have moved
+        newNode = &slab[n];
+        free_drop(t);
+        INST_COUNT(splits);
+
+        newNode->next = trav->next;
+        newNode->last = t;
+
+        /* Her sætter vi den nye nods parameter */
+        newNode->size = trav->size - requested;
+        newNode->alloc = 0;
+        newNode->held = trav->held;     // no more merged than trav was
+        newNode->released = trav->released;
+        newNode->offset = trav->offset + requested;
+        newNode->chunk = trav->chunk;
+        newNode->handle = 0;
+        newNode->sample = 0;
+        newNode->slack = 0;
+        tree_insert(n);
+        free_add(n);
+
+        if (trav->next != NIL)
+            slab[trav->next].last = n;
+        trav->next = n;
+        trav->size = requested;
+    } else {
+        free_drop(t);
+    }
+    trav->alloc = 1;
+    trav->held = 0;
+    trav->released = 0;
+    trav->slack = 0;
+
+    /* Next-fit picks up right after the block just handed out. */
+    hdr->rover = trav->next != NIL ? trav->next : hdr->head;
+    return trav;
+}
+
+/* Like take_block, but allocate the last requested bytes of trav and leave
+ * the remainder free in front of them.  Used for short-lived blocks, so that
+ * they come and go at the high end of a hole and the low end stays whole
+ * for long-lived ones.  The rover is left alone. */
+static struct memoryList *take_block_high(struct memoryList *trav, size_t requested)
+{
+    node_t t = INDEX(trav);
+
+    if (trav->size >= requested + mySplit) {
+        node_t n = new_node();
+        struct memoryList *newNode;
+
+        if (n == NIL)
+            return NULL;
+        trav = &slab[t];        // the slab may have moved
+        newNode = &slab[n];
+        INST_COUNT(splits);
+
+        newNode->next = trav->next;
+        newNode->last = t;
+        newNode->size = requested;
+        newNode->alloc = 1;
+        newNode->held = 0;
+        newNode->released = 0;
+        newNode->offset = trav->offset + trav->size - requested;
+        newNode->chunk = trav->chunk;
+        newNode->handle = 0;
+        newNode->sample = 0;
+        newNode->slack = 0;
+        tree_insert(n);
+
+        if (trav->next != NIL)
+            slab[trav->next].last = n;
+        trav->next = n;
+        free_drop(t);
+        trav->size -= requested;
+        free_add(t);
+        return newNode;
+    }
+    free_drop(t);
+    trav->alloc = 1;
+    trav->held = 0;
+    trav->released = 0;
+    trav->slack = 0;
+    return trav;
+}
+
+/* Add a chunk that can hold at least requested bytes to the end of the pool.
+ * Returns its free block, or NIL if the pool is fixed or no more memory
+ * could be had. */
+static node_t grow_pool(size_t requested)
+{
+	node_t tail;
+	int c;
+
+	if (myGrowth == 0)
+	    return NIL;
+
+	c = add_chunk(requested > myGrowth ? requested : myGrowth);
+	if (c < 0)
+	    return NIL;
+
+	for (tail = hdr->head; slab[tail].next != NIL; tail = slab[tail].next)
+	    ;
+	return chunk_block(c, tail);
+}
+
+/* Give requested bytes a mapping of their own and remember it in the
+ * direct-map table. */
+static void *direct_alloc(size_t requested)
+{
+	struct directMap *d;
+	int applied;
+
+	if (directCount == directCap) {
+	    int cap = directCap ? directCap * 2 : 16;
+	    struct directMap *grown = realloc(directMaps, cap * sizeof(struct directMap));
+	    if (grown == NULL)
+	        return NULL;
+	    directMaps = grown;
+	    directCap = cap;
+	}
+
+	d = &directMaps[directCount];
+	d->ptr = map_pool(requested, myFlags & (MEM_HUGE_TRANSPARENT | MEM_HUGE_EXPLICIT), &d->mapped, &applied);
+	if (d->ptr == NULL)
+	    return NULL;
+	d->size = requested;
+	d->sample = 0;
+	directCount++;
+	directBytes += requested;
+	return d->ptr;
+}
+
+/* Unmap block if it is a direct-mapped one.  Returns 0 if it is not. */
+static int direct_free(void *block)
+{
+	int i;
+
+	for (i = 0; i < directCount; i++) {
+	    if (directMaps[i].ptr == block) {
+	        if (directMaps[i].sample)
+	            profile_drop(directMaps[i].sample);
+	        munmap(block, directMaps[i].mapped);
+	        directBytes -= directMaps[i].size;
+	        directMaps[i] = directMaps[--directCount];
+	        return 1;
+	    }
+	}
+	return 0;
+}
+
+/* Region strategy: every chunk is one allocated block followed by one free
+ * block, and mymalloc moves the boundary between them up by the requested
+ * bytes.  Nothing is recorded per allocation; the list just keeps saying how
+ * much of each chunk is used, so the statistics work as for any strategy.
+ * A request that does not fit the rest of the current chunk moves on to the
+ * next one (growing the pool if there is none), leaving the tail as a hole
+ * until the region is released below it. */
+static void *region_alloc(size_t requested)
+{
+	struct memoryList *f = NODE(hdr->rover);
+	struct memoryList *prev;
+	size_t offset;
+
+	while (f != NULL && (f->alloc || f->size < requested)) {
+	    INST_VISIT();
+	    f = NEXT(f);
+	}
+	if (f == NULL)
+	    f = NODE(grow_pool(requested));
+	if (f == NULL)
+	    return NULL;
+
+	prev = LAST(f);
+	if (prev == NULL || !prev->alloc || prev->chunk != f->chunk) {
+	    /* first bytes taken from this chunk: split off the used block */
+	    f = take_block(f, requested);
+	    if (f == NULL)
+	        return NULL;
+	    hdr->rover = f->next;
+	    return PTR(f);
+	}
+
+	offset = f->offset;
+	free_drop(INDEX(f));
+	prev->size += requested;
+	f->offset += requested;
+	f->size -= requested;
+	hdr->rover = INDEX(f);
+	if (f->size > 0)
+	    free_add(INDEX(f));
+	else {
+	    prev->next = f->next;
+	    if (f->next != NIL)
+	        slab[f->next].last = INDEX(prev);
+	    hdr->rover = f->next;
+	    free_node(INDEX(f));
+	}
+	return (char *) chunks[prev->chunk].base + offset;
+}
+
+/* The size class of a request with MEM_SIZE_CLASSES: rounded up to one of
+ * eight steps between consecutive powers of two, so at most 12.5% of a block
+ * is wasted and freed blocks come in few enough sizes to fit later requests
+ * again.  Other requests are left as they are. */
+static size_t size_class(size_t requested)
+{
+	size_t top = 8;
+
+	if (!(myFlags & MEM_SIZE_CLASSES) || requested <= 8)
+	    return requested;
+	while (top <= requested / 2)
+	    top <<= 1;
+	return ROUND_UP(requested, top / 8);
+}
+
+/* Allocate a block from the pool itself, growing it if nothing fits. */
+static struct memoryList *pool_block(size_t requested, lifetimes lifetime)
+{
+	struct memoryList *block;
+	size_t want = size_class(requested);
+
+	if (want <= myQuick && lifetime == AnyLifetime
+	    && (block = quick_take(want)) != NULL) {
+	    block->slack = block->size - requested;
+	    return block;
+	}
+
+	block = find_fit(want, lifetime);
+	if (block == NULL && (pendingCount > 0 || quickHeld > 0)) {
+	    /* the blocks the worker and the quick lists have yet to merge
+	       may make room */
+	    drain_pending(pendingCount);
+	    quick_flush_all();
+	    block = find_fit(want, lifetime);
+	}
+	if (block == NULL && want > requested) {
+	    /* no room for the whole class, but maybe for the request */
+	    want = requested;
+	    block = find_fit(want, lifetime);
+	}
+	if (block == NULL && grow_pool(want))
+	    block = find_fit(want, lifetime);
+	if (block != NULL && lifetime == ShortLived)
+	    block = take_block_high(block, want);
+	else if (block != NULL)
+	    block = take_block(block, want);
+	if (block != NULL)
+	    block->slack = block->size - requested;
+	return block;
+}
+
+/* Adaptive strategy: look at the pool and pick the search path for the next
+ * period.  A pool that has started failing requests, or whose largest hole is
+ * small next to its free space, needs Best to keep what large holes are left.
+ * One cluttered with slivers needs Worst, which leaves the largest
+ * remainders.  Next is cheapest while the free space is in one piece, and
+ * First does for anything in between. */
+static void adapt_sample()
+{
+	size_t holes, small = 0, largest = 0, free = hdr->free_bytes;
+	strategies wanted;
+	node_t t;
+
+	/* all from the free index: the largest hole is its rightmost node */
+	holes = free_count(hdr->free_tree);
+	for (t = hdr->free_tree; t != NIL; t = slab[t].sright)
+	    largest = slab[t].size;
+	for (t = hdr->free_tree; t != NIL; ) {
+	    if (slab[t].size <= ADAPT_SMALL) {
+	        small += free_count(slab[t].sleft) + 1;
+	        t = slab[t].sright;
+	    } else {
+	        t = slab[t].sleft;
+	    }
+	}
+
+	if (adaptFailed > 0 || largest < free / 2)
+	    wanted = Best;
+	else if (small > holes / 2)
+	    wanted = Worst;
+	else if (holes <= 1 || largest >= free - free / 10)
+	    wanted = Next;
+	else
+	    wanted = First;
+
+	adapt.samples++;
+	adapt.failures += adaptFailed;
+	adapt.periods[adapt.active]++;
+	adaptCalls = adaptFailed = 0;
+
+	if (wanted == adapt.active) {
+	    adaptVotes = 0;
+	    return;
+	}
+	adaptVotes = wanted == adaptWanted ? adaptVotes + 1 : 1;
+	adaptWanted = wanted;
+	if (adaptVotes >= ADAPT_CONFIRM) {
+	    adapt.active = wanted;
+	    adapt.switches++;
+	    adaptVotes = 0;
+	}
+}
+
+/* mymalloc_hint with the pool lock held. */
+static void *alloc_locked(size_t requested, lifetimes lifetime)
+{
+	struct memoryList *block;
+	void *p;
+
+	if (myDirect && requested >= myDirect) {
+	    p = direct_alloc(requested);
+	} else if (myStrategy == Region) {
+	    return region_alloc(requested);
+	} else {
+	    block = pool_block(requested, lifetime);
+	    if (myStrategy == Adaptive) {
+	        adaptFailed += block == NULL;
+	        if (++adaptCalls == ADAPT_PERIOD)
+	            adapt_sample();
+	    }
+	    p = block != NULL ? PTR(block) : NULL;
+	}
+
+	/* all the profiler costs while it is off */
+	if ((profileCountdown -= requested) < 0 && p != NULL)
+	    profile_sample(p, requested);
+	return p;
+}
+
+void *mymalloc(size_t requested)
+{
+	return mymalloc_hint(requested, AnyLifetime);
+}
+
+/* mymalloc for a caller that knows roughly how long the block will live.
+ * Long-lived blocks are placed first-fit from the low end of the pool and
+ * short-lived ones from the high end, so the holes short-lived blocks leave
+ * behind do not end up between long-lived ones.  AnyLifetime, and every hint
+ * under the Region strategy, gives plain mymalloc. */
+void *mymalloc_hint(size_t requested, lifetimes lifetime)
+{
+	void *p;
+	INST_START(start);
+
+	assert((int)myStrategy > 0);
+
+	lock_pool();
+	p = hdr->broken ? NULL : alloc_locked(requested, lifetime);
+	if (p == NULL)
+	    INST_COUNT(failed);
+	INST_OP(malloc_ops, start);
+	TRACE(MEM_TRACE_MALLOC, requested, p, NULL, lifetime);
+	EXPORT(MEM_TRACE_MALLOC, p == NULL);
+	unlock_pool();
+	WATCH();
+	return p;
+}
+
+
+/* The whole pages inside [ptr, ptr+size), as [*lo, *hi).  Returns 0 if the
+ * range does not cover a full page. */
+static int interior_pages(void *ptr, size_t size, char **lo, char **hi)
+{
+	*lo = (char *) ROUND_UP((uintptr_t) ptr, pageSize);
+	*hi = (char *) (((uintptr_t) ptr + size) / pageSize * pageSize);
+	return *hi > *lo;
+}
+
+/* Give the pages [lo, hi) of chunk c back to the kernel.  The range reads
+ * back as zeroes (MADV_DONTNEED) or as either the old bytes or zeroes
+ * (MADV_FREE) and is committed again on the next touch, so nothing else has
+ * to change.  hugetlbfs chunks cannot drop part of a huge page and are left
+ * alone.  Returns the number of bytes handed back. */
+static size_t release_pages(int c, char *lo, char *hi)
+{
+	int advice = MADV_DONTNEED;
+
+	if ((chunks[c].flags & (MEM_HUGE_EXPLICIT | CHUNK_EXTERNAL)) || hi <= lo)
+	    return 0;
+#ifdef MADV_FREE
+	if (myFlags & MEM_RELEASE_LAZY)
+	    advice = MADV_FREE;
+#endif
+	if (madvise(lo, hi - lo, advice) != 0)
+	    return 0;
+	return hi - lo;
+}
+
+/* Give the interior pages of free block b back to the kernel.  b only
+ * counts as released if it has some and they all went. */
+static size_t release_block(struct memoryList *b)
+{
+	char *lo, *hi;
+	size_t res;
+
+	if (!interior_pages(PTR(b), b->size, &lo, &hi))
+	    return 0;
+	res = release_pages(b->chunk, lo, hi);
+	b->released = res == (size_t) (hi - lo);
+	return res;
+}
+
+/* Give back the pages of the free blocks from first on, size bytes in all,
+ * that are about to be merged into one large hole.  Of a block already
+ * released only the pages its ends share with its neighbours are left to
+ * give back, so a block merged into a large hole costs the pages it
+ * brings, not those of the whole hole.  A block's pages count from the page
+ * its first byte is on to the one its last byte is on, which takes in the
+ * pages it shares with its neighbours as well; the hole's own first and
+ * last pages, which it may share with allocated blocks, are left.  Returns
+ * 1 if the hole's interior pages have all been given back now. */
+static int release_run(struct memoryList *first, size_t size)
+{
+	char *lo, *hi, *from = NULL, *to = NULL;
+	struct memoryList *b;
+	size_t done = 0;
+	int all = 1, i;
+
+	if (!interior_pages(PTR(first), size, &lo, &hi))
+	    return 0;
+	for (b = first; done < size; done += b->size, b = NEXT(b)) {
+	    uintptr_t p = (uintptr_t) PTR(b), q = p + b->size;
+	    char *start[2], *end[2];
+
+	    start[0] = (char *) (p / pageSize * pageSize);
+	    end[1] = (char *) ROUND_UP(q, pageSize);
+	    if (b->released) {                  // just the pages at either end
+	        end[0] = (char *) ROUND_UP(p, pageSize);
+	        start[1] = (char *) (q / pageSize * pageSize);
+	    } else {
+	        end[0] = start[1] = end[1];
+	    }
+	    for (i = 0; i < 2; i++) {
+	        if (start[i] < lo)
+	            start[i] = lo;
+	        if (end[i] > hi)
+	            end[i] = hi;
+	        if (start[i] >= end[i])
+	            continue;
+	        if (from != NULL && start[i] > to) {    // not touching the range so far
+	            all &= release_pages(first->chunk, from, to) == (size_t) (to - from);
+	            from = NULL;
+	        }
+	        if (from == NULL)
+	            from = start[i];
+	        if (end[i] > to)
+	            to = end[i];
+	    }
+	}
+	if (from != NULL)
+	    all &= release_pages(first->chunk, from, to) == (size_t) (to - from);
+	return all;
+}
+
+/* Merge the free block after node into node.  Only called for neighbours in
+ * the same chunk.  The block is unlinked before node grows, so a crash in
+ * between is repaired by mem_recover from the offsets. */
+static void absorb_next(struct memoryList *node)
+{
+    node_t gone = node->next;
+    struct memoryList *g = &slab[gone];
+
+    INST_COUNT(merges);
+    node->next = g->next;                    //link node to next next
+    if (g->next != NIL) {                    //if next next exists, link it to node
+        slab[g->next].last = INDEX(node);
+    }
+    if (!node->alloc) {
+        free_drop(INDEX(node));              //re-indexed below at its new size
+    }
+    node->size += g->size;                   //add size to node
+    node->released &= g->released;
+    if (hdr->rover == gone) {                //keep the next-fit rover on a live node
+        hdr->rover = INDEX(node);
+    }
+    free_node(gone);                         //Free next (cause removed from list)
+    if (!node->alloc) {
+        free_add(INDEX(node));
+    }
+}
+
+/* Merge free block hole with the free blocks around it in the same chunk,
+ * and give the pages of the result back if it is large enough.  With the
+ * background worker there can be a run of them; otherwise there is at
+ * most one on either side. */
+static void coalesce(struct memoryList *hole)
+{
+    struct memoryList *b;
+    size_t size = 0;
+    char released = 1;
+
+    while (hole->last != NIL && !LAST(hole)->alloc && LAST(hole)->chunk == hole->chunk) {
+        hole = LAST(hole);                              //the run starts at the first free block before
+    }
+    for (b = hole; b != NULL && !b->alloc && b->chunk == hole->chunk; b = NEXT(b)) {
+        size += b->size;
+        released &= b->released;
+    }
+    if (myRelease && size >= myRelease) {
+        released = release_run(hole, size);             //large hole: give its new pages back
+    }
+    while (hole->next != NIL && !NEXT(hole)->alloc && NEXT(hole)->chunk == hole->chunk) {
+        absorb_next(hole);                              //join with next if not allocated
+    }
+    hole->held = 0;
+    hole->released = released;
+}
+
+/* Queue free block n for the worker.  Returns 0 if the queue is full and
+ * could not grow, in which case the caller merges it right away. */
+static int defer_merge(node_t n)
+{
+    if (pendingCount == pendingCap) {
+        size_t cap = pendingCap ? pendingCap * 2 : 256;
+        node_t *grown = realloc(pending, cap * sizeof(node_t));
+        if (grown == NULL) {
+            return 0;
+        }
+        pending = grown;
+        pendingCap = cap;
+    }
+    pending[pendingCount++] = n;
+    slab[n].held = 1;
+    if (pendingCount == 1) {
+        pthread_mutex_lock(&workerMutex);
+        workerWake = 1;
+        pthread_cond_signal(&workerCond);
+        pthread_mutex_unlock(&workerMutex);
+    }
+    return 1;
+}
+
+/* Merge up to max queued blocks, with the pool lock held. */
+static void drain_pending(size_t max)
+{
+    while (pendingCount > 0 && max-- > 0) {
+        struct memoryList *node = &slab[pending[--pendingCount]];
+
+        if (node->chunk >= 0 && !node->alloc) {
+            coalesce(node);
+        }
+    }
+}
+
+/* Merge the blocks held on the quick list for size. */
+static void quick_flush(size_t size)
+{
+    while (quickCount[size] > 0) {
+        struct memoryList *node = &slab[quickList[size][--quickCount[size]]];
+
+        quickHeld--;
+        if (node->chunk >= 0 && !node->alloc) {
+            coalesce(node);
+        }
+    }
+}
+
+static void quick_flush_all()
+{
+    size_t size;
+
+    for (size = 1; size <= myQuick && quickHeld > 0; size++) {
+        quick_flush(size);
+    }
+}
+
+/* Hold free block n on its quick list.  If the list was full it is merged
+ * instead, which may already have merged n into a neighbour.  Returns 0 if
+ * n is still a block of its own that the caller has to merge. */
+static int quick_hold(node_t n)
+{
+    size_t size = slab[n].size;
+
+    if (quickCount[size] == QUICK_DEPTH) {
+        quick_flush(size);
+        return slab[n].chunk < 0;
+    }
+    quickList[size][quickCount[size]++] = n;
+    quickHeld++;
+    slab[n].held = 1;
+    return 1;
+}
+
+/* A held block of exactly size bytes, now allocated, or NULL. */
+static struct memoryList *quick_take(size_t size)
+{
+    while (quickCount[size] > 0) {
+        struct memoryList *node = &slab[quickList[size][--quickCount[size]]];
+
+        quickHeld--;
+        if (node->chunk >= 0 && !node->alloc && node->size == size) {
+            free_drop(INDEX(node));
+            node->alloc = 1;
+            node->held = 0;
+            node->released = 0;
+            node->slack = 0;
+            return node;
+        }
+    }
+    return NULL;
+}
+
+/* The pool block holding p, which may point anywhere inside it, or NIL if
+ * p is not in the pool.  With the pool lock held.  O(log n). */
+static node_t block_at(char *p)
+{
+    node_t t, found = NIL;
+    size_t offset;
+    int c;
+
+    for (c = 0; c < chunkCount; c++) {
+        if (chunks[c].base != NULL && p >= (char *) chunks[c].base
+            && p < (char *) chunks[c].base + chunks[c].size)
+            break;
+    }
+    if (c == chunkCount)
+        return NIL;
+
+    /* the last block starting at or before p */
+    offset = p - (char *) chunks[c].base;
+    for (t = hdr->tree; t != NIL; ) {
+        INST_VISIT();
+        if (slab[t].chunk < c || (slab[t].chunk == c && slab[t].offset <= offset)) {
+            found = t;
+            t = slab[t].right;
+        } else {
+            t = slab[t].left;
+        }
+    }
+    if (found == NIL || slab[found].chunk != c)
+        return NIL;
+    return found;
+}
+
+/* myfree with the pool lock held. */
+static void free_locked(void* block)
+{
+    node_t n;
+
+    if (directCount && direct_free(block)) {
+        return;
+    }
+    if (myStrategy == Region) {
+        return;             //regions are only freed as a whole, see mem_release
+    }
+    n = block_at(block);    //find block pointed at
+    if (n == NIL) {
+        return;
+    }
+    curr = &slab[n];
+    if (PTR(curr) == block && curr->alloc) { //If found block and allocated
+        curr->alloc = 0;                                    //unalocate (important if not merged into another
+        if (curr->sample) {
+            profile_drop(curr->sample);                     //no longer live in the heap profile
+            curr->sample = 0;
+        }
+        free_add(n);
+        if (curr->size <= myQuick && quick_hold(n)) {
+            return;                                         //kept whole for the next request of its size
+        }
+        if (!workerRunning || !defer_merge(n)) {
+            coalesce(curr);
+        }
+    }
+}
+
+/* Frees a block of memory previously allocated by mymalloc. */
+void myfree(void* block)
+{
+    INST_START(start);
+
+    if (block == NULL) {
+        return;
+    }
+    lock_pool();
+    if (!hdr->broken) {
+        free_locked(block);
+    }
+    INST_OP(free_ops, start);
+    TRACE(MEM_TRACE_FREE, 0, block, NULL, AnyLifetime);
+    EXPORT(MEM_TRACE_FREE, 0);
+    unlock_pool();
+    WATCH();
+}
+
+/* Make allocated block node want bytes long where it is, taking from the
+ * free block after it or handing its tail back as a hole.  Returns 0 if it
+ * cannot grow that far in place. */
+static int resize_block(struct memoryList *node, size_t want)
+{
+    node_t n = INDEX(node), t;
+    struct memoryList *next = NEXT(node), *tail;
+
+    if (node->size < want) {
+        if (next == NULL || next->alloc || next->chunk != node->chunk
+            || node->size + next->size < want) {
+            return 0;
+        }
+        absorb_next(node);
+    }
+    if (node->size >= want + mySplit && (t = new_node()) != NIL) {
+        node = &slab[n];        // the slab may have moved
+        tail = &slab[t];
+        INST_COUNT(splits);
+
+        tail->next = node->next;
+        tail->last = n;
+        tail->size = node->size - want;
+        tail->alloc = 0;
+        tail->held = 0;
+        tail->released = 0;
+        tail->offset = node->offset + want;
+        tail->chunk = node->chunk;
+        tail->handle = 0;
+        tail->sample = 0;
+        tail->slack = 0;
+        tree_insert(t);
+        free_add(t);
+
+        if (node->next != NIL)
+            slab[node->next].last = t;
+        node->next = t;
+        node->size = want;
+        coalesce(tail);
+    }
+    return 1;
+}
+
+/* myrealloc with the pool lock held. */
+static void *realloc_locked(void *block, size_t requested)
+{
+    struct memoryList *node;
+    size_t old;
+    node_t n;
+    void *p;
+    int i;
+
+    for (i = 0; i < directCount && directMaps[i].ptr != block; i++)
+        ;
+    if (i < directCount) {
+        old = directMaps[i].size;
+    } else {
+        n = block_at(block);
+        if (n == NIL || !slab[n].alloc || slab[n].handle != 0) {
+            return NULL;
+        }
+        node = &slab[n];
+        if (myStrategy == Region) {
+            /* blocks are not told apart; all we know is where the run ends */
+            old = PTR(node) + node->size - (char *) block;
+        } else if (PTR(node) != block) {
+            return NULL;
+        } else if (!(myDirect && requested >= myDirect)
+                   && resize_block(node, size_class(requested))) {
+            node = &slab[n];
+            node->slack = node->size - requested;
+            if (node->sample)
+                profile_resize(node->sample, requested);
+            return block;
+        } else {
+            old = node->size - node->slack;
+        }
+    }
+
+    p = alloc_locked(requested, AnyLifetime);
+    if (p == NULL) {
+        return NULL;
+    }
+    memcpy(p, block, old < requested ? old : requested);
+    free_locked(block);
+    return p;
+}
+
+/* Change the size of block to requested bytes, keeping its contents up to
+ * the smaller of the two sizes.  The block stays where it is if it can
+ * shrink, or grow into the free block after it; otherwise it moves and the
+ * old one is freed.  Like realloc, a NULL block is a plain mymalloc and a
+ * size of 0 a plain myfree.  Returns NULL, leaving block alone, if there is
+ * no room or block is not one mymalloc handed out. */
+void *myrealloc(void *block, size_t requested)
+{
+    void *p;
+
+    if (block == NULL) {
+        return mymalloc(requested);
+    }
+    if (requested == 0) {
+        myfree(block);
+        return NULL;
+    }
+    lock_pool();
+    p = hdr->broken ? NULL : realloc_locked(block, requested);
+    TRACE(MEM_TRACE_REALLOC, requested, p, block, AnyLifetime);
+    EXPORT(MEM_TRACE_REALLOC, p == NULL);
+    unlock_pool();
+    WATCH();
+    return p;
+}
+
+/* Allocate a relocatable block of size bytes and return its handle, or 0
+ * if it could not be had.  The block is never direct-mapped.  Its address
+ * is only known, and only stable, between mem_handle_lock and
+ * mem_handle_unlock; in between mem_compact may move it.  Not available for
+ * file-backed or shared pools, or with the Region strategy. */
+mem_handle_t mem_handle_alloc(size_t size)
+{
+	struct memoryList *block;
+	node_t h = 0;
+
+	lock_pool();
+	if (hdr->broken || myMapping != NULL || myStrategy == Region)
+	    goto out;
+
+	if (handleFree != 0) {
+	    h = handleFree;
+	    handleFree = handles[h].node;
+	} else {
+	    if (handleUsed >= handleCap) {
+	        node_t cap = handleCap ? handleCap * 2 : 64;
+	        struct memHandle *grown = realloc(handles, (size_t) cap * sizeof(struct memHandle));
+	        if (grown == NULL)
+	            goto out;
+	        handles = grown;
+	        handleCap = cap;
+	    }
+	    h = handleUsed++;
+	}
+
+	block = pool_block(size, AnyLifetime);
+	if (block == NULL) {
+	    handles[h].node = handleFree;
+	    handleFree = h;
+	    h = 0;
+	    goto out;
+	}
+	block->handle = h;
+	handles[h].node = INDEX(block);
+	handles[h].pins = 0;
+out:
+	unlock_pool();
+	return h;
+}
+
+/* Free the block of handle h.  The handle is invalid afterwards. */
+void mem_handle_free(mem_handle_t h)
+{
+	struct memoryList *block;
+
+	if (h == 0)
+	    return;
+	lock_pool();
+	block = NODE(handles[h].node);
+	block->handle = 0;
+	if (!hdr->broken)
+	    free_locked(PTR(block));
+	handles[h].node = handleFree;
+	handleFree = h;
+	unlock_pool();
+}
+
+/* Pin the block of handle h and return where it is.  Calls nest; the block
+ * may move again once every lock has been undone with mem_handle_unlock. */
+void *mem_handle_lock(mem_handle_t h)
+{
+	void *p;
+
+	lock_pool();
+	handles[h].pins++;
+	p = PTR(NODE(handles[h].node));
+	unlock_pool();
+	return p;
+}
+
+void mem_handle_unlock(mem_handle_t h)
+{
+	lock_pool();
+	handles[h].pins--;
+	unlock_pool();
+}
+
+/* Slide unpinned handle blocks down into the free block in front of them,
+ * so that free space gathers into one hole at the end of each chunk.
+ * Moves at most budget bytes per call (but always at least one block, so a
+ * block larger than budget still gets moved), so compaction can be spread
+ * over many calls without a long pause in any one of them.  Blocks without
+ * a handle, pinned blocks and chunk boundaries stay where they are.
+ * Returns the number of bytes moved; 0 means there is nothing left to do.
+ */
+size_t mem_compact(size_t budget)
+{
+	size_t moved = 0;
+	struct memoryList *f, *b;
+
+	lock_pool();
+	if (hdr->broken) {
+	    unlock_pool();
+	    return 0;
+	}
+	for (f = NODE(hdr->head); f != NULL && (b = NEXT(f)) != NULL; f = NEXT(f)) {
+	    struct memoryList moving;
+
+	    if (f->alloc || !b->alloc || b->chunk != f->chunk
+	        || b->handle == 0 || handles[b->handle].pins > 0)
+	        continue;
+	    if (moved > 0 && moved + b->size > budget)
+	        break;
+
+	    /* b's bytes go to the start of the hole; the two nodes trade
+	       places by trading contents, so the links stay as they are */
+	    memmove(PTR(f), PTR(b), b->size);
+	    moved += b->size;
+	    free_drop(INDEX(f));
+	    moving = *b;
+	    b->size = f->size;
+	    b->offset = f->offset + moving.size;
+	    b->alloc = 0;
+	    b->held = 0;
+	    b->released = 0;
+	    b->handle = 0;
+	    f->size = moving.size;
+	    f->alloc = 1;
+	    f->held = 0;
+	    f->released = 0;
+	    f->handle = moving.handle;
+	    f->slack = moving.slack;
+	    free_add(INDEX(b));
+	    handles[f->handle].node = INDEX(f);
+	    if (hdr->rover == INDEX(f))
+	        hdr->rover = INDEX(b);
+
+	    if (b->next != NIL && !NEXT(b)->alloc && NEXT(b)->chunk == b->chunk)
+	        absorb_next(b);
+	}
+	unlock_pool();
+	return moved;
+}
+
+static void *worker_main(void *arg)
+{
+	size_t more;
+
+	for (;;) {
+	    pthread_mutex_lock(&workerMutex);
+	    while (!workerWake && !workerStop)
+	        pthread_cond_wait(&workerCond, &workerMutex);
+	    workerWake = 0;
+	    if (workerStop) {
+	        pthread_mutex_unlock(&workerMutex);
+	        return NULL;
+	    }
+	    pthread_mutex_unlock(&workerMutex);
+
+	    /* a batch at a time, so mymalloc never waits for a whole burst */
+	    do {
+	        lock_pool();
+	        drain_pending(WORKER_BATCH);
+	        more = pendingCount;
+	        EXPORT(0, 0);
+	        unlock_pool();
+	    } while (more > 0);
+
+	    if (workerBudget > 0)
+	        while (mem_compact(workerBudget) > 0)
+	            ;
+	}
+}
+
+/* Start a background thread that takes merging free blocks off myfree, and
+   with compact_budget > 0 also runs mem_compact(compact_budget) until there
+   is nothing left to move after every burst of frees.  Until it has caught
+   up, the pool may have adjacent free blocks; mymalloc merges them itself if
+   nothing fits otherwise.  A private pool is locked from now on, so it may
+   also be used from several threads.  Returns 0 on success, -1 if the thread
+   could not be started.
+*/
+int mem_worker_start(size_t compact_budget)
+{
+	if (workerRunning)
+	    return 0;
+	workerBudget = compact_budget;
+	workerStop = 0;
+	workerWake = 0;
+	if (poolLock == NULL)
+	    poolLock = &localLock;
+	if (pthread_create(&worker, NULL, worker_main, NULL) != 0) {
+	    if (poolLock == &localLock)
+	        poolLock = NULL;
+	    return -1;
+	}
+	workerRunning = 1;
+	return 0;
+}
+
+/* Stop the background thread and merge whatever it left queued.  initmem
+   and its relatives do this before they touch the pool. */
+void mem_worker_stop()
 {
-	myStrategy = strategy;
+	if (!workerRunning)
+	    return;
+	pthread_mutex_lock(&workerMutex);
+	workerStop = 1;
+	pthread_cond_signal(&workerCond);
+	pthread_mutex_unlock(&workerMutex);
+	pthread_join(worker, NULL);
+	workerRunning = 0;
+
+	lock_pool();
+	drain_pending(pendingCount);
+	unlock_pool();
+	if (poolLock == &localLock)
+	    poolLock = NULL;
+}
 
-	/* all implementations will need an actual block of memory to use */
-	mySize = sz;
-
-	if (myMemory != NULL) free(myMemory); /* in case this is not the first time initmem2 is called */
-
-	if (head != NULL) { //Frees all
-	    curr = head;
-	    head = NULL;
-	    next = NULL;
-	    while (1){
-	        if (curr->next != NULL) {
-	            curr = curr->next;
-	            free(curr->last);
-	        } else {
-	            free(curr);
-	            curr = NULL;
-                break;
+/* Write everything the ring holds if that is at least min records, in at
+ * most two writes.  Only the flusher, or mem_trace_stop once it is gone,
+ * calls this. */
+static void trace_write(size_t min)
+{
+	size_t tail = traceTail;
+	size_t head = __atomic_load_n(&traceHead, __ATOMIC_ACQUIRE);
+	size_t n, done;
+	ssize_t w;
+
+	if (head - tail == 0 || head - tail < min)
+	    return;
+	while (tail != head) {
+	    n = TRACE_RING - (tail & (TRACE_RING - 1));     // up to the end of the ring
+	    if (n > head - tail)
+	        n = head - tail;
+	    for (done = 0; traceFd >= 0 && done < n * sizeof(struct mem_trace_record); done += w) {
+	        w = write(traceFd, (char *) &traceRing[tail & (TRACE_RING - 1)] + done,
+	                  n * sizeof(struct mem_trace_record) - done);
+	        if (w < 0 && errno == EINTR) {
+	            w = 0;
+	        } else if (w <= 0) {
+	            close(traceFd);         // keep emptying the ring, but count the rest as lost
+	            traceFd = -1;
 	        }
 	    }
-
+	    if (traceFd < 0)
+	        __atomic_add_fetch(&traceLost, n, __ATOMIC_RELAXED);
+	    tail += n;
 	}
+	__atomic_store_n(&traceTail, tail, __ATOMIC_RELEASE);
+}
 
-	/* TODO: release any other memory you were using for bookkeeping when doing a re-initialization! */
-
-
-	myMemory = malloc(sz);
-	
-	head = (struct memoryList*) malloc(sizeof(struct memoryList)); //Init head with initial values
-	head->next = NULL;
-	head->last = NULL;
-	head->size = mySize;
-	head->alloc = 0;
-	head->ptr = myMemory;
+static void *trace_main(void *arg)
+{
+	struct timespec until;
+	int idle = 0;
+
+	pthread_mutex_lock(&traceMutex);
+	while (!traceStop) {
+	    clock_gettime(CLOCK_REALTIME, &until);
+	    until.tv_nsec += 1000000;
+	    if (until.tv_nsec >= 1000000000) {
+	        until.tv_sec++;
+	        until.tv_nsec -= 1000000000;
+	    }
+	    pthread_cond_timedwait(&traceCond, &traceMutex, &until);
+	    pthread_mutex_unlock(&traceMutex);
+
+	    /* a full batch every millisecond, or whatever there is every 100 */
+	    if (++idle == 100) {
+	        trace_write(1);
+	        idle = 0;
+	    } else {
+	        trace_write(TRACE_BATCH);
+	    }
+	    pthread_mutex_lock(&traceMutex);
+	}
+	pthread_mutex_unlock(&traceMutex);
+	return NULL;
+}
 
-	if (myStrategy == Next) {
-	    next = head;
+/* Record every initmem (and initmem_opts, initmem_file, initmem_shared),
+   mymalloc, mymalloc_hint, myfree and myrealloc call from now on in the
+   binary file path, which is created or truncated.  The file is a struct
+   mem_trace_header followed by one struct mem_trace_record per call.  The
+   calls only add a record to a ring buffer; a thread of its own writes the
+   ring out in large sequential writes.  Records that find the ring full are
+   dropped, never waited for, and counted by mem_trace_stop.  File-backed
+   and shared pools are recorded as the private pool of size 0 that
+   initmem_file and initmem_shared start from, followed by a second
+   MEM_TRACE_INIT with the size of the pool they attach to.  Tracing
+   carries on across initmem.  Returns 0 on success, -1 if the file or the
+   thread could not be had.
+*/
+int mem_trace_start(const char *path)
+{
+	struct mem_trace_header h;
+
+	if (traceRing != NULL)
+	    return -1;
+	memset(&h, 0, sizeof(h));
+	memcpy(h.magic, MEM_TRACE_MAGIC, sizeof(h.magic));
+	h.version = MEM_TRACE_VERSION;
+	h.record_size = sizeof(struct mem_trace_record);
+
+	traceFd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (traceFd < 0)
+	    return -1;
+	if (write(traceFd, &h, sizeof(h)) != sizeof(h))
+	    goto fail;
+	traceRing = malloc(TRACE_RING * sizeof(struct mem_trace_record));
+	if (traceRing == NULL)
+	    goto fail;
+	traceHead = traceTail = traceLost = 0;
+	traceLast = trace_clock();     // the first record's delta is from now
+	traceStop = 0;
+	if (pthread_create(&traceThread, NULL, trace_main, NULL) != 0) {
+	    free(traceRing);
+	    traceRing = NULL;
+	    goto fail;
 	}
+	return 0;
 
+fail:
+	close(traceFd);
+	traceFd = -1;
+	return -1;
+}
 
+/* Stop tracing, write out what is left and close the file.  Must not race
+   with allocator calls from other threads.  Returns the number of records
+   that were lost, because the ring was full or the file could not be
+   written; 0 means the trace is complete. */
+size_t mem_trace_stop()
+{
+	if (traceRing == NULL)
+	    return 0;
+	pthread_mutex_lock(&traceMutex);
+	traceStop = 1;
+	pthread_cond_signal(&traceCond);
+	pthread_mutex_unlock(&traceMutex);
+	pthread_join(traceThread, NULL);
+
+	trace_write(1);
+	if (traceFd >= 0)
+	    close(traceFd);
+	traceFd = -1;
+	free(traceRing);
+	traceRing = NULL;
+	return __atomic_load_n(&traceLost, __ATOMIC_RELAXED);
 }
 
-/* Allocate a block of memory with the requested size.
- *  If the requested block is not available, mymalloc returns NULL.
- *  Otherwise, it returns a pointer to the newly allocated block.
- *  Restriction: requested >= 1 
- */
+/* Publish the state of the pool, and op (a MEM_TRACE_* code, 0 for none)
+ * if it is a call to count, with the pool lock held. */
+static void export_update(int op, int failed)
+{
+	struct mem_shared_stats *x = exported;
+	uint64_t largest = 0;
+	node_t t;
+
+	for (t = hdr->free_tree; t != NIL; t = slab[t].sright)
+	    largest = slab[t].size;
+
+	__atomic_store_n(&x->seq, x->seq + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	x->updates++;
+	x->strategy = myStrategy;
+	x->total = mySize + directBytes;
+	x->allocated = mySize - hdr->free_bytes + directBytes;
+	x->free = hdr->free_bytes;
+	x->holes = free_count(hdr->free_tree);
+	x->largest_free = largest;
+	x->failed += failed;
+	if (op == MEM_TRACE_MALLOC) {
+	    x->malloc_calls++;
+	    if (exportLatency >= 0)
+	        x->malloc_latency[exportLatency]++;
+	} else if (op == MEM_TRACE_FREE) {
+	    x->free_calls++;
+	    if (exportLatency >= 0)
+	        x->free_latency[exportLatency]++;
+	} else if (op == MEM_TRACE_REALLOC) {
+	    x->realloc_calls++;
+	}
+	exportLatency = -1;
+	__atomic_store_n(&x->seq, x->seq + 1, __ATOMIC_RELEASE);
+}
 
-// Søg funktion for Worst-Fit strategi.
-// gotten from Volkan Isik s180103
-struct memoryList* worstSearch(size_t size){
-    struct memoryList *search = NULL;
-    struct memoryList *biggestnode = NULL;
-    search = head;
-    int worstSize = 0;
+/* Publish the mem_* statistics in the POSIX shared memory object name (see
+   shm_open), created if need be, as a struct mem_shared_stats.  Every
+   mymalloc, myfree and myrealloc from now on updates it before it returns,
+   as do initmem, mem_reset, mem_release and the background worker, so a
+   monitoring process can read it at any rate with mem_export_open and
+   mem_export_read without ever calling into the allocator or taking its
+   locks.  The call counts accumulate in the object, so a shared pool can
+   publish to one object from all its processes; other pools need one
+   object per process.  The latency buckets are only filled in when the
+   allocator is built with MEM_INSTRUMENT.  The object outlives the process
+   until shm_unlink(name).  Returns 0 on success, -1 on error.
+*/
+int mem_export_start(const char *name)
+{
+	struct mem_shared_stats *x;
+	int fd;
+
+	mem_export_stop();
+	fd = shm_open(name, O_RDWR | O_CREAT, 0644);
+	if (fd < 0)
+	    return -1;
+	if (ftruncate(fd, sizeof(*x)) != 0) {
+	    close(fd);
+	    return -1;
+	}
+	x = mmap(NULL, sizeof(*x), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (x == MAP_FAILED)
+	    return -1;
+
+	lock_pool();
+	if (x->magic != MEM_EXPORT_MAGIC || x->version != MEM_EXPORT_VERSION) {
+	    memset(x, 0, sizeof(*x));
+	    x->version = MEM_EXPORT_VERSION;
+#ifdef MEM_INSTRUMENT
+	    x->latency = 1;
+#endif
+	    __atomic_store_n(&x->magic, MEM_EXPORT_MAGIC, __ATOMIC_RELEASE);
+	}
+	x->pid = getpid();
+	exported = x;
+	export_update(0, 0);
+	unlock_pool();
+	return 0;
+}
 
-    while (search!=NULL){
-        if(search->size>=size && search->alloc==0){
-            if(search->size > worstSize) {
-                biggestnode = search;
-                worstSize = search->size;
-            }
-        }
-        search=search->next;
-    }
-    if(biggestnode != NULL)
-        return biggestnode;
-    else
-        return NULL;
+/* Stop publishing.  The object keeps the last statistics. */
+void mem_export_stop()
+{
+	if (exported == NULL)
+	    return;
+	lock_pool();
+	munmap(exported, sizeof(*exported));
+	exported = NULL;
+	unlock_pool();
 }
 
-// Søg funktion for First-Fit strategi.
-// gotten from Volkan Isik s180103
-struct memoryList* firstSearch(size_t size){
-    struct memoryList *search = NULL;
-    search = head;
+/* Map the statistics that some process publishes as name, read-only, for
+   mem_export_read.  Returns NULL if there are none. */
+const struct mem_shared_stats *mem_export_open(const char *name)
+{
+	struct mem_shared_stats *x;
+	struct stat st;
+	int fd = shm_open(name, O_RDONLY, 0);
+
+	if (fd < 0)
+	    return NULL;
+	if (fstat(fd, &st) != 0 || (size_t) st.st_size < sizeof(*x)) {
+	    close(fd);
+	    return NULL;
+	}
+	x = mmap(NULL, sizeof(*x), PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (x == MAP_FAILED)
+	    return NULL;
+	if (__atomic_load_n(&x->magic, __ATOMIC_ACQUIRE) != MEM_EXPORT_MAGIC
+	    || x->version != MEM_EXPORT_VERSION) {
+	    munmap(x, sizeof(*x));
+	    return NULL;
+	}
+	return x;
+}
 
-    while (search!=NULL){
-        if(search->size >= size && search->alloc==0){
-            return search;
-        }
-        search=search->next;
-    }
-    return NULL;
+/* Copy a consistent snapshot of seg to *copy.  Never blocks the allocator;
+   gives up and returns -1 if it kept changing for a thousand tries. */
+int mem_export_read(const struct mem_shared_stats *seg, struct mem_shared_stats *copy)
+{
+	uint64_t before, after;
+	int tries;
+
+	for (tries = 0; tries < 1000; tries++) {
+	    before = __atomic_load_n(&seg->seq, __ATOMIC_ACQUIRE);
+	    if (before & 1)
+	        continue;
+	    memcpy(copy, (const void *) seg, sizeof(*copy));
+	    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+	    after = __atomic_load_n(&seg->seq, __ATOMIC_RELAXED);
+	    if (before == after)
+	        return 0;
+	}
+	return -1;
 }
 
-//Opretter en memoryblock og placerer den før eller overtager den block der blev givet.
-// gotten from Volkan Isik s180103
-struct memoryList* insert(struct memoryList* explode, size_t size){
+void mem_export_close(const struct mem_shared_stats *seg)
+{
+	if (seg != NULL)
+	    munmap((void *) seg, sizeof(*seg));
+}
 
-    if(explode->size==size && explode->alloc==0){
-        explode->alloc=1;
-        if(explode->next==NULL){
-            explode->ptr=explode->last->ptr+explode->last->size;
-        }
-        return explode;
-    }
+/* Bytes until the next sample: exponentially distributed with mean
+ * profileRate, so that every byte allocated is equally likely to be the
+ * one that gets its block sampled. */
+static int64_t profile_gap()
+{
+	double u;
+
+	if (profileRate == 0)
+	    return INT64_MAX;
+	profileSeed ^= profileSeed << 13;
+	profileSeed ^= profileSeed >> 7;
+	profileSeed ^= profileSeed << 17;
+	u = ((profileSeed >> 11) + 1) / 9007199254740992.0;     // in (0, 1]
+	return (int64_t) (-log(u) * profileRate);
+}
 
-    //Opretter en ny node og placerer den i iforhold til given block
-    struct memoryList *node = (struct memoryList*) malloc(sizeof(struct memoryList)*1);
-    node->size=size;
-    node->alloc=1;
-    if(explode->last!=NULL)
-        node->ptr=(explode->last->ptr+explode->last->size);
-    else
-        node->ptr=explode->ptr;
-    explode->size-=size;
+/* The stack table entry for frames, made if there is none.  Returns 0 if
+ * the table could not grow, the entry plus one otherwise. */
+static uint32_t profile_stack(void **frames, int depth)
+{
+	uint32_t h = 0, e;
+	int i;
+
+	for (i = 0; i < depth; i++)
+	    h = (h ^ (uint32_t) ((uintptr_t) frames[i] >> 4)) * 0x01000193;
+	h %= PROFILE_HASH;
+	for (e = stackHash[h]; e != 0; e = stacks[e - 1].next) {
+	    if (stacks[e - 1].depth == depth
+	        && memcmp(stacks[e - 1].frames, frames, depth * sizeof(void *)) == 0)
+	        return e;
+	}
 
-    if(explode->last != NULL){
-        explode->last->next=node;
-        node->last=explode->last;
-        node->next=explode;
-        explode->last=node;
-    } else{
-        node->last=NULL;
-        node->next=explode;
-        explode->last=node;
-        head = node;
-    }
-    return node;
+	if (stackCount == stackCap) {
+	    uint32_t cap = stackCap ? stackCap * 2 : 64;
+	    struct memStack *grown = realloc(stacks, cap * sizeof(struct memStack));
+	    if (grown == NULL)
+	        return 0;
+	    stacks = grown;
+	    stackCap = cap;
+	}
+	e = ++stackCount;
+	memset(&stacks[e - 1], 0, sizeof(struct memStack));
+	stacks[e - 1].depth = depth;
+	memcpy(stacks[e - 1].frames, frames, depth * sizeof(void *));
+	stacks[e - 1].next = stackHash[h];
+	stackHash[h] = e;
+	return e;
 }
 
-/* Denne metode indsætter en ny node efter den valgte node.  */
-void insertNewNodeAfter(struct memoryList *trav, size_t requested, void *travPtr){
+/* Sample the block at p, just allocated for size bytes, and set the
+ * countdown to the next one.  With the pool lock held. */
+static void profile_sample(void *p, size_t size)
+{
+	void *frames[PROFILE_DEPTH + 1];
+	node_t *tag = NULL, s, n;
+	uint32_t e;
+	int depth, i;
+
+	profileCountdown = profile_gap();
+	if (profileRate == 0 || myMapping != NULL)
+	    return;
+
+	for (i = 0; i < directCount && tag == NULL; i++) {
+	    if (directMaps[i].ptr == p)
+	        tag = &directMaps[i].sample;
+	}
+	if (tag == NULL && (n = block_at(p)) != NIL)
+	    tag = &slab[n].sample;
+	if (tag == NULL)
+	    return;
+
+	/* leave this function out of the stack */
+	depth = backtrace(frames, PROFILE_DEPTH + 1);
+	if (depth <= 1 || (e = profile_stack(frames + 1, depth - 1)) == 0)
+	    return;
+
+	if (sampleFree != 0) {
+	    s = sampleFree;
+	    sampleFree = samples[s].stack;
+	} else {
+	    if (sampleUsed >= sampleCap) {
+	        node_t cap = sampleCap ? sampleCap * 2 : 64;
+	        struct memSample *grown = realloc(samples, cap * sizeof(struct memSample));
+	        if (grown == NULL)
+	            return;
+	        samples = grown;
+	        sampleCap = cap;
+	    }
+	    s = sampleUsed++;
+	}
+	samples[s].stack = e - 1;
+	samples[s].size = size;
+	stacks[e - 1].live++;
+	stacks[e - 1].live_bytes += size;
+	stacks[e - 1].count++;
+	stacks[e - 1].bytes += size;
+	*tag = s;
+}
 
-    if(trav == NULL){
-        return;
-    }
+/* Sample s is no longer live: its block was freed. */
+static void profile_drop(node_t s)
+{
+	struct memStack *st = &stacks[samples[s].stack];
 
-    /* Her bliver den nye node alloceret i vores hukommelse.  */
-    struct memoryList *newNode = malloc(sizeof(struct memoryList));
+	st->live--;
+	st->live_bytes -= samples[s].size;
+	samples[s].stack = sampleFree;
+	sampleFree = s;
+}
 
-    /* Hvis vores nodes next_node ikke er NULL kan pointerne blive opdeateret */
-    if(trav -> next != NULL){
-        newNode -> next = trav -> next;
-        trav -> next -> last = newNode;
+/* The block of sample s now holds size bytes. */
+static void profile_resize(node_t s, size_t size)
+{
+	struct memStack *st = &stacks[samples[s].stack];
 
-        newNode -> last = trav;
-        trav -> next = newNode;
-    }
-        /* Hvis vores nodes next_node er lig med null er det slutningen af vores liste og pointerne bliver opdateret */
-    else{
-        trav -> next = newNode;
-        newNode -> last = trav;
-        newNode -> next = NULL;
-        //tail = newNode;
-    }
+	st->live_bytes += size - samples[s].size;
+	samples[s].size = size;
+}
 
-    /* Her sætter vi den nye nods parameter */
-    newNode -> size = trav -> size - requested;
-    newNode -> alloc = 0;
-    newNode -> ptr = travPtr + requested;
+/* Drop every live sample.  With untag set, the blocks are told as well;
+ * without it the caller is about to throw away every block anyway. */
+static void profile_forget(int untag)
+{
+	struct memoryList *b;
+	uint32_t e;
+	int i;
+
+	if (untag) {
+	    for (b = NODE(hdr->head); b != NULL; b = NEXT(b))
+	        b->sample = 0;
+	    for (i = 0; i < directCount; i++)
+	        directMaps[i].sample = 0;
+	}
+	for (e = 0; e < stackCount; e++)
+	    stacks[e].live = stacks[e].live_bytes = 0;
+	sampleUsed = 1;
+	sampleFree = 0;
+}
 
-    /* Her sætter vi den gamle nodes parametre.  */
-    trav -> alloc = 1;
-    trav -> size = requested;
+/* Sample roughly one allocation in every rate bytes allocated, the gaps
+   between samples being random (exponential, with mean rate) so that no
+   allocation pattern can hide from it.  A sampled block carries the call
+   stack of its mymalloc (or myrealloc) until it is freed; mem_profile_dump
+   writes out what is live.  mymalloc pays a backtrace per sample and,
+   while the profiler is off, a single counter decrement.  Blocks of the
+   Region strategy and handle blocks are not sampled.  Starting again drops
+   the samples taken so far; rate 0 is mem_profile_stop.  Private pools
+   only.  Returns 0 on success, -1 for a file-backed or shared pool.
+*/
+int mem_profile_start(size_t rate)
+{
+	if (rate == 0) {
+	    mem_profile_stop();
+	    return 0;
+	}
+	if (myMapping != NULL)
+	    return -1;
+	lock_pool();
+	profile_forget(1);
+	stackCount = 0;
+	memset(stackHash, 0, sizeof(stackHash));
+	profileRate = rate;
+	profileCountdown = profile_gap();
+	unlock_pool();
+	return 0;
 }
 
-void *mymalloc(size_t requested)
+void mem_profile_stop()
 {
-	assert((int)myStrategy > 0);
+	lock_pool();
+	profile_forget(1);
+	free(stacks);
+	free(samples);
+	stacks = NULL;
+	samples = NULL;
+	stackCount = stackCap = 0;
+	sampleCap = 0;
+	memset(stackHash, 0, sizeof(stackHash));
+	profileRate = 0;
+	profileCountdown = INT64_MAX;
+	unlock_pool();
+}
 
-	if (requested > mem_largest_free()){
-        return NULL;
+/* Write the samples to path as a heap profile in the text format of
+   gperftools, which pprof reads: a header with the totals and the sampling
+   rate, one line per call stack with its live and its ever-sampled blocks
+   and bytes, then the mappings of the process so the addresses can be
+   symbolized.  pprof scales the sampled counts back up by the rate.  The
+   stack table is copied under the pool lock and written after it is
+   released.  Returns 0 on success, -1 on error.
+*/
+int mem_profile_dump(const char *path)
+{
+	size_t live = 0, live_bytes = 0, count = 0, bytes = 0, rate;
+	struct memStack *copy;
+	uint32_t n, e;
+	char line[4096];
+	FILE *f, *maps;
+	int i;
+
+	lock_pool();
+	n = stackCount;
+	rate = profileRate;
+	copy = malloc((n + 1) * sizeof(struct memStack));
+	if (copy == NULL) {
+	    unlock_pool();
+	    return -1;
 	}
-	
-	switch (myStrategy)
-	  {
-	  case NotSet: 
-	            return NULL;
-	  case First:
-      { //Gotten from Volkan Isik s180103
-          struct memoryList *explode = firstSearch(requested);
-          if(explode)
-              return insert(explode,requested)->ptr;
-          break;
-      }
-	  case Best:
-	      curr = head; //Start at head
-	      while (1) {
-	          if (!curr->alloc && curr->size >= requested) { //If not allocated and have room to store requested do:
-	              if (next != NULL) { //If another free block is found do:
-	                  if (curr->size < next->size) { //If the new block is smaller than the first block do:
-                          next = curr; //Save smallest available block possible
-	                  }
-	              } else { //If no block has been found yet
-                      next = curr; //save first block found. continue to look for better options.
-	              }
-	          }
-	          if (curr->next != NULL) { //If list not done
-	              curr = curr->next; // go to next
-	          } else
-                  break; //else stop search
-	      }
-	      if (next->size == requested) { //If block found has exactly the right size
-	          next->alloc = 1; //allocate it, without splitting it
-	          void *temp = next->ptr;
-	          next = NULL; //Release next for future user
-              return temp;
-	      } else { //else block has extra room and needs to be split
-              struct memoryList *new = malloc(sizeof(struct memoryList)); //create new listitem with extra space left.
-              new->size = next->size - requested;
-              new->next = next->next;//put in list between foound block and the next one
-              new->last = next;
-              new->alloc = 0; //starts unallocated
-              new->ptr = next->ptr + requested;
-              next->size = requested; //update found block to be allocated with the right size
-              next->next = new;
-              next->alloc = 1;
-              if (new->next != NULL) { //If new has a next, make next point back to new
-                  new->next->last = new;
-              }
-              next = NULL; //Release next for future user
-              return new->last->ptr;
-	      }
-	  case Worst:
-      {
-          //søger efter en fri memoryblok som er den største i hele memory'et
-          struct memoryList *explode = worstSearch(requested);
-          if(explode)
-              //memoryblok placeres og pointeren returneres
-              return insert(explode,requested)->ptr;
-          break;
-      }
-	  case Next:
-          while (curr -> size <= requested && curr -> alloc != 0){
-              if(curr -> next == NULL){
-                  curr = head;
-              }
-              else if(curr -> next == next){
-                  return NULL;
-              }
-              else{
-                  curr = curr -> next;
-              }
-          }
-
-              /* Når vi så har fundet vores node kigger vi på om størrelsen passer. */
-              if(curr -> size >= requested){
-
-                  /* Hvis størrelsen passer præcist skal dens allocering bare sættes til 1. */
-                  if(curr -> size == requested){
-                      curr -> alloc = 1;
-                      if(curr -> next == NULL){
-                          next = head;
-                      }
-                      else{
-                          next = curr;
-                      }
-                      return curr -> ptr;
-                  }
-
-                  /* Vi sætter den nye node ind. */
-                  insertNewNodeAfter(curr, requested, curr -> ptr);
-
-              }
-
-              /* Her opdatere vi vores next pointer til det næste. Hvis den er ved slutningen bliver det sat til head ellers den næste. */
-              if (curr -> next != NULL){
-                  next = curr -> next;
-              }
-              else{
-                  next = head;
-              }
-              return curr->ptr;
-	  }
-	return NULL;
+	if (n > 0)
+	    memcpy(copy, stacks, n * sizeof(struct memStack));
+	unlock_pool();
+
+	f = fopen(path, "w");
+	if (f == NULL) {
+	    free(copy);
+	    return -1;
+	}
+	for (e = 0; e < n; e++) {
+	    live += copy[e].live;
+	    live_bytes += copy[e].live_bytes;
+	    count += copy[e].count;
+	    bytes += copy[e].bytes;
+	}
+	fprintf(f, "heap profile: %6zu: %8zu [%6zu: %8zu] @ heap_v2/%zu\n",
+	        live, live_bytes, count, bytes, rate);
+	for (e = 0; e < n; e++) {
+	    fprintf(f, "%6zu: %8zu [%6zu: %8zu] @", copy[e].live, copy[e].live_bytes,
+	            copy[e].count, copy[e].bytes);
+	    for (i = 0; i < copy[e].depth; i++)
+	        fprintf(f, " %p", copy[e].frames[i]);
+	    fprintf(f, "\n");
+	}
+	free(copy);
+
+	fprintf(f, "\nMAPPED_LIBRARIES:\n");
+	maps = fopen("/proc/self/maps", "r");
+	if (maps != NULL) {
+	    while (fgets(line, sizeof(line), maps) != NULL)
+	        fputs(line, f);
+	    fclose(maps);
+	}
+	return fclose(f) == 0 ? 0 : -1;
 }
 
-
-/* Frees a block of memory previously allocated by mymalloc. */
-void myfree(void* block)
+/* Tell the watchers about any watermark that was crossed. */
+static void watch_check()
 {
-    if (block == NULL) {
-        return;
-    }
-    curr = head; //start at head
-	while (1) { //loop though list to find block pointed at
-	    if (curr->ptr == block && curr->alloc) { //If found block and allocated
-	        curr->alloc = 0;                                    //unalocate (important if not merged into another
-
-            if(curr->last != NULL && !curr->last->alloc) {      //combine with last if not allocated
-                curr->last->size += curr->size;                 //add size to last
-                curr->last->next = curr->next;                  //link last to next
-
-                if(curr->next != NULL) {                        //If next is a link
-                    curr->next->last = curr->last;              //link next to last
-
-                    if (!curr->next->alloc) {                   //if it is not allocated, join with last
-                        curr->last->size += curr->next->size;   //add size to last
-                        curr->last->next = curr->next->next;    //link last to next next
-                        if (curr->next->next != NULL) {         //if next next exists, link it to last
-                            curr->next->next->last = curr->last;
-                        }
-                        free(curr->next);                       //Free next (cause removed from list)
-                    }
-                    free(curr);                                 //Free curr (cause removed from list)
-                }
-            } else if(curr->next != NULL && !curr->next->alloc) { //If last is null or allocated, check if next is null or allocated, and join if needed
-                curr->size += curr->next->size;                 //put size in next
-                if (curr->next->next != NULL) {
-                    curr->next = curr->next->next;              //link current to next next
-                    free(curr->next->last);                     //Free next
-                    curr->next->last = curr;                    //link next to current.
-                } else {
-                    free(curr->next);                           //End of list, free last and make curr point to null
-                    curr->next = NULL;
-                }
-            }
-            return;
-	    } else if (curr->next != NULL) { //go to next if not found yet
-            curr = curr->next;
-        } else {
-            return;
+	struct mem_pressure ev;
+	struct timespec ts;
+	uint64_t now = 0;
+	int i, kind, high;
+
+	if (__atomic_exchange_n(&watchBusy, 1, __ATOMIC_ACQUIRE))
+	    return;
+
+	for (i = 0, ev.free = SIZE_MAX; i < MAX_WATCHERS; i++) {
+	    struct memWatcher *w = &watchers[i];
+
+	    for (kind = MEM_PRESSURE_ALLOC; kind <= MEM_PRESSURE_FRAG && w->fn != NULL; kind++) {
+	        if (ev.free == SIZE_MAX) {
+	            /* again after every callback, which may have changed them */
+	            ev.allocated = mem_allocated();
+	            ev.free = mem_free();
+	            ev.largest_free = mem_largest_free();
+	            ev.fragmentation = ev.free > 0 ? 1.0 - (double) ev.largest_free / ev.free : 0;
+	        }
+	        if (kind == MEM_PRESSURE_ALLOC) {
+	            if (w->marks.alloc_high == 0)
+	                continue;
+	            high = w->high[kind] ? ev.allocated >= w->marks.alloc_low
+	                                 : ev.allocated >= w->marks.alloc_high;
+	        } else {
+	            if (w->marks.frag_high <= 0)
+	                continue;
+	            high = w->high[kind] ? ev.fragmentation >= w->marks.frag_low
+	                                 : ev.fragmentation >= w->marks.frag_high;
+	        }
+	        if (high == w->high[kind])
+	            continue;
+
+	        /* too soon after the last call: left for a later check */
+	        if (w->marks.interval_ms > 0) {
+	            if (now == 0) {
+	                clock_gettime(CLOCK_MONOTONIC, &ts);
+	                now = (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+	            }
+	            if (w->last != 0 && now - w->last < (uint64_t) w->marks.interval_ms * 1000000)
+	                continue;
+	            w->last = now;
+	        }
+	        w->high[kind] = high;
+	        ev.kind = kind;
+	        ev.high = high;
+	        w->fn(&ev, w->ctx);
+	        ev.free = SIZE_MAX;
 	    }
 	}
+	__atomic_store_n(&watchBusy, 0, __ATOMIC_RELEASE);
+}
+
+/* Call fn(event, ctx) when memory pressure starts or ends, so a cache can
+   give memory back before mymalloc starts failing.  Pressure on allocated
+   bytes starts when mem_allocated() reaches marks->alloc_high and ends when
+   it is back below marks->alloc_low; pressure on fragmentation likewise
+   with 1 - mem_largest_free() / mem_free() against marks->frag_high and
+   marks->frag_low.  Leave a high mark 0 to not watch it.  The marks are
+   looked at after every mymalloc, myfree and myrealloc, outside the pool
+   lock, so fn may free, compact and allocate itself; what it does is not
+   reported to it again until it has returned.  With marks->interval_ms,
+   fn is called at most that often; a crossing that comes too soon is
+   reported at the first check after the interval if it still holds.
+   Returns an id for mem_unwatch, or -1 if MAX_WATCHERS are registered.
+*/
+int mem_watch(const struct mem_watermarks *marks, mem_pressure_fn fn, void *ctx)
+{
+	int i;
+
+	for (i = 0; i < MAX_WATCHERS && watchers[i].fn != NULL; i++)
+	    ;
+	if (i == MAX_WATCHERS || fn == NULL)
+	    return -1;
+	memset(&watchers[i], 0, sizeof(watchers[i]));
+	watchers[i].marks = *marks;
+	watchers[i].ctx = ctx;
+	watchers[i].fn = fn;
+	watchCount++;
+	return i;
+}
+
+void mem_unwatch(int id)
+{
+	if (id < 0 || id >= MAX_WATCHERS || watchers[id].fn == NULL)
+	    return;
+	watchers[id].fn = NULL;
+	watchCount--;
 }
 
 /****** Memory status/property functions ******
@@ -375,106 +3262,299 @@ void myfree(void* block)
  */
 
 /* Get the number of contiguous areas of free space in memory. */
-int mem_holes()
+size_t mem_holes()
 {
-    int res = 0;
-    curr = head;
-    while (1) {
-        if (!curr->alloc) {
-            res += 1;
-        }
-        if (curr->next != NULL) {
-            curr = curr->next;
-        } else {
-            return res;
-        }
-    }
+    size_t res;
+    lock_pool();
+    res = free_count(hdr->free_tree);
+    unlock_pool();
+    return res;
+}
+
+/* Get the number of bytes allocated, direct-mapped blocks included */
+size_t mem_allocated()
+{
+    size_t res;
+    lock_pool();
+    res = mySize - hdr->free_bytes + directBytes;
+    unlock_pool();
+    return res;
+}
 
+/* Number of non-allocated bytes */
+size_t mem_free()
+{
+    size_t res;
+    lock_pool();
+    res = hdr->free_bytes;
+    unlock_pool();
+    return res;
 }
 
-/* Get the number of bytes allocated */
-int mem_allocated()
+/* Bytes of allocated blocks beyond what was asked for: size class rounding
+ * and remainders too small to split off (mem_options.min_split). */
+size_t mem_wasted()
 {
-    int res = 0;
-    curr = head;
-    while (1) {
+    size_t res = 0;
+    lock_pool();
+    for (curr = NODE(hdr->head); curr != NULL; curr = NEXT(curr)) {
         if (curr->alloc) {
-            res += curr->size;
+            res += curr->slack;
         }
-        if (curr->next != NULL) {
-            curr = curr->next;
-        } else {
+    }
+    unlock_pool();
+    return res;
+}
+
+/* Count the resident bytes of [lo, hi), which must be page aligned. */
+static size_t resident_bytes(char *lo, char *hi)
+{
+    unsigned char vec[4096];
+    size_t res = 0;
+
+    while (lo < hi) {
+        size_t pages = (hi - lo) / pageSize;
+        size_t i;
+        if (pages > sizeof(vec))
+            pages = sizeof(vec);
+        if (mincore(lo, pages * pageSize, vec) != 0)
             return res;
-        }
+        for (i = 0; i < pages; i++)
+            res += (vec[i] & 1) * pageSize;
+        lo += pages * pageSize;
     }
+    return res;
+}
 
+/* Number of pool bytes currently resident in RAM (whole pages, so a
+ * malloc'ed pool may count a partial page on either end). */
+size_t mem_resident()
+{
+    size_t res = 0;
+    int c;
+
+    for (c = 0; c < chunkCount; c++) {
+        char *lo = (char *) ((uintptr_t) chunks[c].base / pageSize * pageSize);
+        char *hi = (char *) ROUND_UP((uintptr_t) chunks[c].base + chunks[c].size, pageSize);
+        if (chunks[c].base != NULL)
+            res += resident_bytes(lo, hi);
+    }
+    return res;
 }
 
-/* Number of non-allocated bytes */
-int mem_free()
+/* Resident bytes in whole pages of free blocks: what mem_trim(0) could hand
+ * back to the kernel right now. */
+size_t mem_reclaimable()
 {
-    int res = 0;
-    curr = head;
-    while (1) {
-        if (!curr->alloc) {
-            res += curr->size;
-        }
-        if (curr->next != NULL) {
-            curr = curr->next;
-        } else {
-            return res;
+    size_t res = 0;
+    char *lo, *hi;
+
+    lock_pool();
+    for (curr = NODE(hdr->head); curr != NULL; curr = NEXT(curr)) {
+        if (!curr->alloc && interior_pages(PTR(curr), curr->size, &lo, &hi)) {
+            res += resident_bytes(lo, hi);
         }
     }
+    unlock_pool();
+    return res;
+}
+
+/* Give the pages of every free block of at least minblock bytes back to the
+ * kernel.  For callers that would rather run this as a periodic pass than
+ * pay for it inside myfree (mem_options.release).  Returns the number of
+ * bytes advised away. */
+size_t mem_trim(size_t minblock)
+{
+    size_t res = 0;
 
+    lock_pool();
+    for (curr = NODE(hdr->head); curr != NULL; curr = NEXT(curr)) {
+        if (!curr->alloc && curr->size >= minblock) {
+            res += release_block(curr);
+        }
+    }
+    unlock_pool();
+    return res;
 }
 
 /* Number of bytes in the largest contiguous area of unallocated memory */
-int mem_largest_free()
+size_t mem_largest_free()
 {
-    int res = 0;
-    curr = head;
-    while (1) {
-        if (!curr->alloc && curr->size > res) {
-            res = curr->size;
-        }
-        if (curr->next != NULL) {
-            curr = curr->next;
+    size_t res = 0;
+    node_t t;
+    lock_pool();
+    for (t = hdr->free_tree; t != NIL; t = slab[t].sright) {
+        res = slab[t].size;
+    }
+    unlock_pool();
+    return res;
+}
+
+/* Number of free blocks of at most "size" bytes. */
+size_t mem_small_free(size_t size)
+{
+    size_t res = 0;
+    node_t t;
+    lock_pool();
+    for (t = hdr->free_tree; t != NIL; ) {
+        if (slab[t].size <= size) {
+            res += free_count(slab[t].sleft) + 1;
+            t = slab[t].sright;
         } else {
-            return res;
+            t = slab[t].sleft;
         }
     }
+    unlock_pool();
+    return res;
+}
 
+/* The number of free blocks in each power-of-two size range: counts[i] is
+ * the number of 2^i to 2^(i+1)-1 bytes.  counts must have room for
+ * MEM_HIST_BUCKETS entries. */
+void mem_free_histogram(size_t *counts)
+{
+    lock_pool();
+    memcpy(counts, hdr->histogram, sizeof(hdr->histogram));
+    unlock_pool();
 }
 
-/* Number of free blocks smaller than "size" bytes. */
-int mem_small_free(int size)
+/* Find the block holding ptr, which may point anywhere inside it, and
+ * describe it in *block.  Direct-mapped blocks count as well.  Returns 1 if
+ * ptr is in the pool or a direct-mapped block and 0 if not.  O(log n). */
+int mem_block_of(void *ptr, struct mem_block *block)
 {
-    int res = 0;
-    curr = head;
-    while (1) {
-        if (!curr->alloc && curr->size <= size) {
-            res += 1;
-        }
-        if (curr->next != NULL) {
-            curr = curr->next;
-        } else {
-            return res;
+    char *p = ptr;
+    node_t found;
+    int i;
+
+    lock_pool();
+    for (i = 0; i < directCount; i++) {
+        if (p >= (char *) directMaps[i].ptr && p < (char *) directMaps[i].ptr + directMaps[i].size) {
+            block->base = directMaps[i].ptr;
+            block->size = directMaps[i].size;
+            block->alloc = 1;
+            unlock_pool();
+            return 1;
         }
     }
+    found = hdr->broken ? NIL : block_at(p);
+    if (found == NIL) {
+        unlock_pool();
+        return 0;
+    }
+    block->base = PTR(&slab[found]);
+    block->size = slab[found].size;
+    block->alloc = slab[found].alloc;
+    unlock_pool();
+    return 1;
+}
 
-}       
+/* Call fn for every block, in address order, then for every direct-mapped
+ * block, until it returns nonzero.  The pool is locked throughout, so fn
+ * must not call the allocator.  Returns the number of blocks fn was called
+ * for. */
+size_t mem_walk(mem_walk_fn fn, void *ctx)
+{
+    struct mem_block block;
+    struct memoryList *b;
+    size_t n = 0;
+    int i;
+
+    lock_pool();
+    for (b = hdr->broken ? NULL : NODE(hdr->head); b != NULL; b = NEXT(b)) {
+        block.base = PTR(b);
+        block.size = b->size;
+        block.alloc = b->alloc;
+        n++;
+        if (fn(&block, ctx) != 0) {
+            unlock_pool();
+            return n;
+        }
+    }
+    for (i = 0; i < directCount; i++) {
+        block.base = directMaps[i].ptr;
+        block.size = directMaps[i].size;
+        block.alloc = 1;
+        n++;
+        if (fn(&block, ctx) != 0)
+            break;
+    }
+    unlock_pool();
+    return n;
+}
 
-char mem_is_alloc(void *ptr)
+/* Write the block table to fd as a struct mem_snapshot_header followed by
+ * a struct mem_snapshot_block per block, the way mem_walk sees them.  The
+ * table is copied out under the pool lock and written with a single
+ * write() after it is released, so a live process is only held up for as
+ * long as the copy takes.  memmap turns the result into a fragmentation
+ * map.  Returns 0 on success, -1 if it could not be written. */
+int mem_snapshot(int fd)
 {
-    curr = head;
-    while (1) {
-        if (curr->ptr == ptr) {
-            return curr->alloc;
-        } else {
-            curr = curr->next;
+    struct mem_snapshot_header *h;
+    struct mem_snapshot_block *r;
+    struct memoryList *b;
+    size_t n = 0, len, done;
+    ssize_t w;
+    char *buf;
+    int i;
+
+    lock_pool();
+    for (b = hdr->broken ? NULL : NODE(hdr->head); b != NULL; b = NEXT(b))
+        n++;
+    n += directCount;
+    len = sizeof(*h) + n * sizeof(*r);
+    buf = malloc(len);
+    if (buf == NULL) {
+        unlock_pool();
+        return -1;
+    }
+
+    h = (struct mem_snapshot_header *) buf;
+    memset(h, 0, sizeof(*h));
+    memcpy(h->magic, MEM_SNAPSHOT_MAGIC, sizeof(h->magic));
+    h->version = MEM_SNAPSHOT_VERSION;
+    h->record_size = sizeof(*r);
+    h->blocks = n;
+    h->total = mySize + directBytes;
+    h->strategy = myStrategy;
+    h->chunks = chunkCount;
+
+    r = (struct mem_snapshot_block *) (h + 1);
+    for (b = hdr->broken ? NULL : NODE(hdr->head); b != NULL; b = NEXT(b), r++) {
+        r->offset = b->offset;
+        r->size = b->size;
+        r->chunk = b->chunk;
+        r->flags = (b->alloc ? MEM_SNAPSHOT_ALLOC : 0) | (b->handle ? MEM_SNAPSHOT_HANDLE : 0);
+    }
+    for (i = 0; i < directCount; i++, r++) {
+        r->offset = (uintptr_t) directMaps[i].ptr;
+        r->size = directMaps[i].size;
+        r->chunk = MEM_SNAPSHOT_DIRECT;
+        r->flags = MEM_SNAPSHOT_ALLOC;
+    }
+    unlock_pool();
+
+    for (done = 0; done < len; done += w) {
+        w = write(fd, buf + done, len - done);
+        if (w < 0 && errno == EINTR) {
+            w = 0;
+        } else if (w <= 0) {
+            free(buf);
+            return -1;
         }
     }
+    free(buf);
+    return 0;
+}
+
+/* Is the byte at ptr part of an allocated block?  0 for a free block and
+ * for addresses outside the pool. */
+char mem_is_alloc(void *ptr)
+{
+    struct mem_block block;
 
+    return mem_block_of(ptr, &block) && block.alloc;
 }
 
 /* 
@@ -489,10 +3569,130 @@ void *mem_pool()
 	return myMemory;
 }
 
-// Returns the total number of bytes in the memory pool. */
-int mem_total()
+// How the pool is backed, see initmem_opts().
+backings mem_backing()
+{
+	return myBacking;
+}
+
+// The MEM_* flags that actually took effect, e.g. MEM_HUGE_TRANSPARENT
+// after a MEM_HUGE_EXPLICIT request fell back.
+int mem_backing_flags()
+{
+	return chunks[0].flags;
+}
+
+// Returns the total number of bytes in the memory pool, over all chunks,
+// plus the bytes of direct-mapped blocks. */
+size_t mem_total()
+{
+	return mySize + directBytes;
+}
+
+// Root block of a persistent pool, so a process that attaches to it with
+// initmem_file can find its data again.  Lives in chunk 0.
+void *mem_root()
+{
+	return hdr->root ? (char *) chunks[0].base + hdr->root - 1 : NULL;
+}
+
+void mem_set_root(void *ptr)
+{
+	hdr->root = ptr ? (size_t) ((char *) ptr - (char *) chunks[0].base) + 1 : 0;
+}
+
+// Offset of ptr in the pool, and the pointer for such an offset.  Pointers
+// into a shared pool differ between processes that attached it separately,
+// offsets do not.
+size_t mem_offset(void *ptr)
 {
-	return mySize;
+	return (char *) ptr - (char *) chunks[0].base;
+}
+
+void *mem_at(size_t offset)
+{
+	return (char *) chunks[0].base + offset;
+}
+
+// What the Adaptive strategy is doing: the search path it currently uses,
+// how often it has switched, and how many sampling periods it spent on each.
+void mem_adaptive(struct mem_adaptive_stats *stats)
+{
+	lock_pool();
+	*stats = adapt;
+	unlock_pool();
+}
+
+// Bucket of mem_op_stats.latency for a call that took t cycles: four
+// buckets per power of two, so each is within 25% of its neighbours.
+int mem_latency_bucket(uint64_t t)
+{
+	int msb = 0;
+
+	if (t < 4)
+	    return (int) t;
+	while (t >> (msb + 1))
+	    msb++;
+	return msb * 4 + (int) ((t >> (msb - 2)) & 3);
+}
+
+// The fewest cycles a call in latency bucket b can have taken.
+uint64_t mem_latency_floor(int b)
+{
+	if (b < 8)
+	    return b < 4 ? b : 4;   // 4 to 7 are never used
+
+	return (uint64_t) (4 + (b & 3)) << (b / 4 - 2);
+}
+
+// Snapshot of the instrumentation counters for a strategy; all zero unless
+// built with -DMEM_INSTRUMENT.
+void mem_get_stats(strategies strategy, struct mem_stats *stats)
+{
+	memset(stats, 0, sizeof(*stats));
+#ifdef MEM_INSTRUMENT
+	if (strategy >= 0 && strategy <= Adaptive) {
+	    lock_pool();
+	    *stats = instStats[strategy];
+	    unlock_pool();
+	}
+#endif
+}
+
+void mem_clear_stats()
+{
+#ifdef MEM_INSTRUMENT
+	lock_pool();
+	memset(instStats, 0, sizeof(instStats));
+	unlock_pool();
+#endif
+}
+
+// For tests of mem_verify: set the alloc flag of the pool block starting at
+// ptr and change nothing else, not even the indexes.  Returns 1 if it did,
+// and 0 if ptr does not start a block or the allocator is not built with
+// -DMEM_INSTRUMENT, where this does nothing.
+int mem_test_set_alloc(void *ptr, int alloc)
+{
+	int done = 0;
+#ifdef MEM_INSTRUMENT
+	node_t n;
+
+	lock_pool();
+	n = hdr->broken ? NIL : block_at(ptr);
+	if (n != NIL && PTR(&slab[n]) == (char *) ptr) {
+	    slab[n].alloc = alloc;
+	    done = 1;
+	}
+	unlock_pool();
+#endif
+	return done;
+}
+
+// Number of blocks that bypassed the pool with a mapping of their own.
+size_t mem_direct_blocks()
+{
+	return directCount;
 }
 
 
@@ -509,6 +3709,10 @@ char *strategy_name(strategies strategy)
 			return "first";
 		case Next:
 			return "next";
+		case Region:
+			return "region";
+		case Adaptive:
+			return "adaptive";
 		default:
 			return "unknown";
 	}
@@ -533,6 +3737,14 @@ strategies strategyFromString(char * strategy)
 	{
 		return Next;
 	}
+	else if (!strcmp(strategy,"region"))
+	{
+		return Region;
+	}
+	else if (!strcmp(strategy,"adaptive"))
+	{
+		return Adaptive;
+	}
 	else
 	{
 		return 0;
@@ -548,16 +3760,16 @@ strategies strategyFromString(char * strategy)
 /* Use this function to print out the current contents of memory. */
 void print_memory()
 {
-    curr = head;
+    curr = NODE(hdr->head);
     int count = 0;
     while (1) {
         printf("listitem %d\n",count);
         count += 1;
-        printf("size: %d, allocated: %s\n", curr->size, curr->alloc ? "true" : "false");
-        printf("pointer %02x\n", curr->ptr);
+        printf("size: %zu, allocated: %s\n", curr->size, curr->alloc ? "true" : "false");
+        printf("pointer %p\n", (void *) PTR(curr));
         printf("--------------------------------\n");
-        if (curr->next != NULL) {
-            curr = curr->next;
+        if (curr->next != NIL) {
+            curr = NEXT(curr);
         } else {
             return;
         }
@@ -570,8 +3782,8 @@ void print_memory()
  */ 
 void print_memory_status()
 {
-	printf("%d out of %d bytes allocated.\n",mem_allocated(),mem_total());
-	printf("%d bytes are free in %d holes; maximum allocatable block is %d bytes.\n",mem_free(),mem_holes(),mem_largest_free());
+	printf("%zu out of %zu bytes allocated.\n",mem_allocated(),mem_total());
+	printf("%zu bytes are free in %zu holes; maximum allocatable block is %zu bytes.\n",mem_free(),mem_holes(),mem_largest_free());
 	printf("Average hole size is %f.\n\n",((float)mem_free())/mem_holes());
 }
 
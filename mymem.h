@@ -1,4 +1,5 @@
 #include <stddef.h>
+#include <stdint.h>
 
 typedef enum strategies_enum
 {
@@ -6,25 +7,285 @@ typedef enum strategies_enum
 	Best = 1,
 	Worst = 2,
 	First = 3,
-	Next = 4
+	Next = 4,
+	Region = 5,	/* bump allocation, freed only as a whole with mem_release() or mem_reset() */
+	Adaptive = 6	/* switches between the four above from how fragmented the pool is */
 } strategies;
 
+typedef enum backings_enum
+{
+	Heap = 0,	/* pool comes from malloc(), the default */
+	Mapped = 1,	/* pool is an anonymous mmap(), committed page by page on first touch */
+	FileBacked = 2,	/* pool and its block list live in a MAP_SHARED file, see initmem_file() */
+	Shared = 3	/* pool lives in POSIX shared memory, see initmem_shared() */
+} backings;
+
+/* Buckets of mem_free_histogram(): bucket i counts the free blocks of
+ * 2^i to 2^(i+1)-1 bytes */
+#define MEM_HIST_BUCKETS 64
+
+/* Hint for mymalloc_hint() */
+typedef enum lifetimes_enum
+{
+	AnyLifetime = 0,	/* same as mymalloc() */
+	ShortLived = 1,		/* freed again soon; placed at the high end of the pool */
+	LongLived = 2		/* kept for a long time; placed at the low end of the pool */
+} lifetimes;
+
+/* Flags for mem_options.flags */
+#define MEM_HUGE_TRANSPARENT	0x1	/* align the pool to 2 MiB and madvise(MADV_HUGEPAGE) */
+#define MEM_HUGE_EXPLICIT	0x2	/* MAP_HUGETLB, falls back to transparent huge pages */
+#define MEM_PREFAULT		0x4	/* touch every page in initmem instead of committing lazily */
+#define MEM_RELEASE_LAZY	0x8	/* release free pages with MADV_FREE instead of MADV_DONTNEED */
+#define MEM_SIZE_CLASSES	0x10	/* round requests up to size classes 12.5% apart, see mem_wasted() */
+
+/* Optional settings for initmem_opts().  A zeroed struct gives the same
+ * behaviour as plain initmem(). */
+struct mem_options
+{
+	backings backing;
+	int flags;
+	size_t grow;	/* when nothing fits, add a chunk of at least this many bytes; 0 = fixed pool */
+	size_t release;	/* myfree hands the pages of free blocks this large back to the OS; 0 = never */
+	size_t direct;	/* requests this large get their own mmap instead of a pool block; 0 = never */
+	size_t quick;	/* freed blocks up to this size (at most 256) wait unmerged for a request of
+			   the same size; 0 = never */
+	size_t min_split;	/* remainders smaller than this stay with the block, see mem_wasted(); 0 = 1 */
+};
+
+/* A block as seen by mem_block_of() */
+struct mem_block
+{
+	void *base;	/* first byte of the block */
+	size_t size;
+	char alloc;	/* 1 if allocated, 0 if free */
+};
+
+/* What mem_verify() found wrong first; 0 = nothing */
+#define MEM_VERIFY_LINKS	1	/* next and last links disagree, or a dead node is linked */
+#define MEM_VERIFY_LAYOUT	2	/* blocks overlap, leave a gap or do not cover their chunk */
+#define MEM_VERIFY_ADJACENT	3	/* two free blocks next to each other that nothing will merge */
+#define MEM_VERIFY_INDEX	4	/* a block missing from the address index or the free index */
+#define MEM_VERIFY_COUNTERS	5	/* free bytes, holes or the histogram disagree with the blocks */
+
+/* Called by mem_walk() for every block; a nonzero return stops the walk */
+typedef int (*mem_walk_fn)(const struct mem_block *block, void *ctx);
+
+/* A heap snapshot, see mem_snapshot(): one header followed by one record per
+ * block in address order, in the byte order of the machine that wrote it */
+#define MEM_SNAPSHOT_MAGIC	"MEMSNAPS"
+#define MEM_SNAPSHOT_VERSION	1
+
+#define MEM_SNAPSHOT_ALLOC	0x1	/* the block is allocated */
+#define MEM_SNAPSHOT_HANDLE	0x2	/* ...and may be moved by mem_compact() */
+#define MEM_SNAPSHOT_DIRECT	0xffffffff	/* chunk of a direct-mapped block */
+
+struct mem_snapshot_header
+{
+	char magic[8];		/* MEM_SNAPSHOT_MAGIC, not terminated */
+	uint32_t version;
+	uint32_t record_size;	/* sizeof(struct mem_snapshot_block) */
+	uint64_t blocks;	/* records that follow */
+	uint64_t total;		/* mem_total() */
+	uint32_t strategy;
+	uint32_t chunks;	/* chunks the pool is made of */
+};
+
+struct mem_snapshot_block
+{
+	uint64_t offset;	/* in its chunk; the address for a direct-mapped block */
+	uint64_t size;
+	uint32_t chunk;		/* blocks of one chunk are contiguous and cover it */
+	uint32_t flags;		/* MEM_SNAPSHOT_* */
+};
+
+/* What the Adaptive strategy has been doing, see mem_adaptive() */
+struct mem_adaptive_stats
+{
+	strategies active;	/* search path in use: Best, Worst, First or Next */
+	size_t switches;	/* times it changed */
+	size_t samples;		/* times the pool was looked at, one per 256 allocations */
+	size_t failures;	/* failed allocations seen by those samples */
+	size_t periods[5];	/* samples taken while each path was in use, indexed by strategy */
+};
+
+/* Instrumentation counters, see mem_get_stats().  Only collected when the
+ * allocator is built with -DMEM_INSTRUMENT. */
+#define MEM_LAT_BUCKETS 256
+
+struct mem_op_stats
+{
+	size_t calls;
+	uint64_t cycles;	/* over all calls; TSC cycles on x86, nanoseconds elsewhere */
+	size_t visited;		/* block nodes looked at while searching */
+	size_t latency[MEM_LAT_BUCKETS];	/* calls by time taken, see mem_latency_bucket() */
+};
+
+struct mem_stats
+{
+	struct mem_op_stats malloc_ops;
+	struct mem_op_stats free_ops;
+	size_t splits;		/* blocks split in two to fit a request */
+	size_t merges;		/* free blocks merged into a neighbour */
+	size_t failed;		/* mymalloc calls that returned NULL */
+};
+
+/* Allocation trace, see mem_trace_start().  The file is one header
+ * followed by one fixed-size record per call, in the byte order of the
+ * machine that wrote it. */
+#define MEM_TRACE_MAGIC	"MEMTRACE"
+#define MEM_TRACE_VERSION	1
+
+#define MEM_TRACE_INIT		1	/* initmem and its relatives; size = pool bytes */
+#define MEM_TRACE_MALLOC	2	/* mymalloc / mymalloc_hint; id = 0 if it failed */
+#define MEM_TRACE_FREE		3	/* myfree */
+#define MEM_TRACE_REALLOC	4	/* myrealloc; old_id = the block resized, id = 0 if it failed */
+
+struct mem_trace_header
+{
+	char magic[8];		/* MEM_TRACE_MAGIC, not terminated */
+	uint32_t version;
+	uint32_t record_size;	/* sizeof(struct mem_trace_record) */
+};
+
+struct mem_trace_record
+{
+	uint8_t op;		/* MEM_TRACE_* */
+	uint8_t strategy;	/* strategy of the pool at the time */
+	uint8_t lifetime;	/* hint given to mymalloc_hint */
+	uint8_t reserved;
+	uint32_t delta;		/* nanoseconds since the previous record or mem_trace_start, saturating */
+	uint64_t size;		/* bytes requested */
+	uint64_t id;		/* the block: its address in the traced process */
+	uint64_t old_id;
+};
+
+/* Statistics published in shared memory, see mem_export_start().  The
+ * allocator bumps seq to an odd value before it changes the rest and to the
+ * next even value after, so a reader copies the struct between two reads
+ * of seq that agree and are even; mem_export_read() does just that. */
+#define MEM_EXPORT_MAGIC	0x5453544f4d454d59ULL	/* "YMEMOTST" */
+#define MEM_EXPORT_VERSION	1
+
+struct mem_shared_stats
+{
+	uint64_t magic;		/* MEM_EXPORT_MAGIC once the segment is set up */
+	uint32_t version;
+	uint32_t latency;	/* 1 if the latency buckets are kept, see MEM_INSTRUMENT */
+	uint64_t seq;
+	uint64_t updates;	/* times the allocator changed the struct */
+	uint32_t strategy;	/* strategy of the pool */
+	uint32_t pid;		/* process that last called mem_export_start */
+	uint64_t total;		/* mem_total() */
+	uint64_t allocated;	/* mem_allocated() */
+	uint64_t free;		/* mem_free() */
+	uint64_t holes;		/* mem_holes() */
+	uint64_t largest_free;	/* mem_largest_free() */
+	uint64_t malloc_calls;	/* mymalloc and mymalloc_hint */
+	uint64_t free_calls;	/* myfree */
+	uint64_t realloc_calls;	/* myrealloc */
+	uint64_t failed;	/* of those, the ones that returned NULL for want of room */
+	uint64_t malloc_latency[MEM_LAT_BUCKETS];	/* see mem_latency_bucket() */
+	uint64_t free_latency[MEM_LAT_BUCKETS];
+};
+
+/* Memory pressure, see mem_watch().  Each watermark pair has hysteresis:
+ * pressure starts when the value reaches high and ends only once it is
+ * back below low. */
+#define MEM_PRESSURE_ALLOC	1	/* mem_allocated() */
+#define MEM_PRESSURE_FRAG	2	/* fragmentation, 1 - mem_largest_free() / mem_free() */
+
+struct mem_watermarks
+{
+	size_t alloc_high;	/* 0 = allocated bytes not watched */
+	size_t alloc_low;
+	double frag_high;	/* 0 = fragmentation not watched */
+	double frag_low;
+	unsigned interval_ms;	/* at least this long between two calls of the callback */
+};
+
+struct mem_pressure
+{
+	int kind;		/* MEM_PRESSURE_* */
+	int high;		/* 1 when pressure starts, 0 when it ends */
+	size_t allocated;
+	size_t free;
+	size_t largest_free;
+	double fragmentation;
+};
+
+typedef void (*mem_pressure_fn)(const struct mem_pressure *event, void *ctx);
+
+/* Names a block that mem_compact may move, see mem_handle_alloc(); 0 = none */
+typedef unsigned int mem_handle_t;
+
 char *strategy_name(strategies strategy);
 strategies strategyFromString(char * strategy);
 
 
 void initmem(strategies strategy, size_t sz);
+void initmem_opts(strategies strategy, size_t sz, const struct mem_options *opts);
+int initmem_file(strategies strategy, size_t sz, const char *path);
+int initmem_shared(strategies strategy, size_t sz, const char *name);
+void mem_close();
+void mem_reset();
+size_t mem_mark();
+void mem_release(size_t mark);
+int mem_recover();
+int mem_verify(size_t window);
 void *mymalloc(size_t requested);
+void *mymalloc_hint(size_t requested, lifetimes lifetime);
 void myfree(void* block);
+void *myrealloc(void *block, size_t requested);
+mem_handle_t mem_handle_alloc(size_t size);
+void mem_handle_free(mem_handle_t h);
+void *mem_handle_lock(mem_handle_t h);
+void mem_handle_unlock(mem_handle_t h);
+size_t mem_compact(size_t budget);
+int mem_worker_start(size_t compact_budget);
+void mem_worker_stop();
+int mem_trace_start(const char *path);
+size_t mem_trace_stop();
+int mem_export_start(const char *name);
+void mem_export_stop();
+const struct mem_shared_stats *mem_export_open(const char *name);
+int mem_export_read(const struct mem_shared_stats *seg, struct mem_shared_stats *copy);
+void mem_export_close(const struct mem_shared_stats *seg);
+int mem_profile_start(size_t rate);
+void mem_profile_stop();
+int mem_profile_dump(const char *path);
+int mem_watch(const struct mem_watermarks *marks, mem_pressure_fn fn, void *ctx);
+void mem_unwatch(int id);
 
-int mem_holes();
-int mem_allocated();
-int mem_free();
-int mem_total();
-int mem_largest_free();
-int mem_small_free(int size);
+size_t mem_holes();
+size_t mem_allocated();
+size_t mem_free();
+size_t mem_wasted();
+size_t mem_resident();
+size_t mem_reclaimable();
+size_t mem_trim(size_t minblock);
+size_t mem_total();
+size_t mem_direct_blocks();
+size_t mem_largest_free();
+size_t mem_small_free(size_t size);
+void mem_free_histogram(size_t *counts);
 char mem_is_alloc(void *ptr);
+int mem_block_of(void *ptr, struct mem_block *block);
+size_t mem_walk(mem_walk_fn fn, void *ctx);
+int mem_snapshot(int fd);
 void* mem_pool();
+void* mem_root();
+void mem_set_root(void *ptr);
+size_t mem_offset(void *ptr);
+void* mem_at(size_t offset);
+backings mem_backing();
+int mem_backing_flags();
+void mem_adaptive(struct mem_adaptive_stats *stats);
+void mem_get_stats(strategies strategy, struct mem_stats *stats);
+void mem_clear_stats();
+int mem_test_set_alloc(void *ptr, int alloc);
+int mem_latency_bucket(uint64_t t);
+uint64_t mem_latency_floor(int b);
 void print_memory();
 void print_memory_status();
 void try_mymem(int argc, char **argv);